@@ -0,0 +1,214 @@
+#include "batch.hpp"
+#include "queue.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/timer/timer.hpp>
+
+using std::string;
+using std::vector;
+
+// An image between two stages of the batch
+struct BatchImage
+{
+    string name;
+    Bitmap image;
+};
+
+vector<string> batchFiles(const string &path)
+{
+    vector<string> files;
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        DIR *dir = opendir(path.c_str());
+        while (dirent *entry = dir? readdir(dir) : NULL)
+        {
+            string name = entry->d_name;
+            if (boost::iends_with(name, ".bmp"))
+            {
+                files.push_back(path + "/" + name);
+            }
+        }
+        if (dir)
+        {
+            closedir(dir);
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+    std::ifstream list(path.c_str());
+    string line;
+    while (std::getline(list, line))
+    {
+        boost::trim(line);
+        if (!line.empty())
+        {
+            files.push_back(line);
+        }
+    }
+    return files;
+}
+
+static string baseName(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos? path : path.substr(slash + 1);
+}
+
+size_t runBatch(Pipeline &pipeline, const vector<string> &files,
+                const string &outputDir, PixelStorage storage,
+                PixelLayout layout, int ioThreads)
+{
+    struct stat info;
+    if (mkdir(outputDir.c_str(), 0777) != 0
+        && (stat(outputDir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)))
+    {
+        throw std::runtime_error("Directory " + outputDir
+                                 + " could not be made");
+    }
+
+    // Results are written under their input's name, so only the first of
+    // several inputs with the same name is filtered
+    std::atomic<size_t> failed(0);
+    vector<bool> duplicate(files.size(), false);
+    std::map<string, string> names;
+    for (size_t f = 0; f < files.size(); f++)
+    {
+        string name = baseName(files[f]);
+        if (names.count(name))
+        {
+            std::cerr << "File " << files[f] << " has the same name as "
+                      << names[name] << std::endl;
+            duplicate[f] = true;
+            failed++;
+            continue;
+        }
+        names[name] = files[f];
+    }
+
+    BoundedQueue<BatchImage> decoded(ioThreads*2), filtered(ioThreads*2);
+    std::atomic<size_t> next(0);
+    std::atomic<int> reading(ioThreads);
+
+    boost::timer::cpu_timer timer;
+
+    vector<std::thread> readers, writers;
+    for (int i = 0; i < ioThreads; i++)
+    {
+        readers.push_back(std::thread([&]()
+        {
+            for (size_t f = next++; f < files.size(); f = next++)
+            {
+                if (duplicate[f])
+                {
+                    continue;
+                }
+
+                BatchImage item;
+                item.name = baseName(files[f]);
+                item.image.storage = storage;
+                item.image.layout = layout;
+                try
+                {
+                    item.image.read(files[f]);
+                }
+                catch (std::runtime_error &e)
+                {
+                    // One bad file is skipped, not the rest of the batch
+                    std::cerr << e.what() << std::endl;
+                    failed++;
+                    continue;
+                }
+                if (!decoded.push(std::move(item)))
+                {
+                    break;
+                }
+            }
+            if (--reading == 0)
+            {
+                decoded.close();
+            }
+        }));
+
+        writers.push_back(std::thread([&]()
+        {
+            BatchImage item;
+            while (filtered.pop(item))
+            {
+                try
+                {
+                    item.image.write(outputDir + "/" + item.name);
+                }
+                catch (std::runtime_error &e)
+                {
+                    std::cerr << e.what() << std::endl;
+                    failed++;
+                }
+                item.image.release();
+            }
+        }));
+    }
+
+    // The filters run on this thread, so the device sees one chain at a
+    // time while the others decode and encode around it
+    size_t count = 0;
+    double filterTime = 0;
+    std::exception_ptr error;
+    try
+    {
+        BatchImage item;
+        while (decoded.pop(item))
+        {
+            TraceSpan span("filter " + item.name);
+            pipeline.run(item.image);
+            const vector<double> &times = pipeline.filterTimes();
+            for (size_t i = 0; i < times.size(); i++)
+            {
+                filterTime += times[i];
+            }
+            count++;
+            filtered.push(std::move(item));
+        }
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+        decoded.close();
+    }
+
+    filtered.close();
+    for (int i = 0; i < ioThreads; i++)
+    {
+        readers[i].join();
+        writers[i].join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    double seconds = timer.elapsed().wall / 1e9;
+    printf("Filtered %zu images in %0.3f s (%0.1f images/s)\n", count,
+           seconds, count / std::max(seconds, 1e-9));
+    printf("Filters took %0.3f ms per image\n",
+           count? filterTime / count : 0.0);
+    if (failed > 0)
+    {
+        printf("%zu files could not be read or written\n",
+               (size_t)failed);
+    }
+    return failed;
+}
@@ -0,0 +1,24 @@
+#ifndef BATCH_HPP_GUARD
+#define BATCH_HPP_GUARD
+
+#include <string>
+#include <vector>
+#include "pipeline.hpp"
+#include "bmp.hpp"
+
+// The .bmp files of a directory in name order, or the files a list file
+// names one per line
+std::vector<std::string> batchFiles(const std::string &path);
+
+// Filters every file with one pipeline in this process and writes each
+// result under its own name into outputDir. ioThreads threads decode files
+// ahead of the filters and as many encode results behind them, with at
+// most ioThreads*2 images waiting between stages. Images of the same size
+// reuse the pipeline's kernels and buffers. Files that cannot be read or
+// whose result cannot be written are reported on stderr and skipped, as
+// are files with the name of an earlier one, and their number returned.
+size_t runBatch(Pipeline &pipeline, const std::vector<std::string> &files,
+                const std::string &outputDir, PixelStorage storage,
+                PixelLayout layout, int ioThreads);
+
+#endif
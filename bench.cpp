@@ -0,0 +1,154 @@
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sys/resource.h>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::ostream;
+using std::endl;
+
+StageSummary summarise(vector<double> samples)
+{
+    StageSummary summary = {0, 0, 0};
+    if (samples.empty())
+    {
+        return summary;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    summary.min = samples[0];
+    summary.median = n % 2? samples[n/2]
+                          : (samples[n/2 - 1] + samples[n/2]) / 2;
+    // Nearest rank
+    summary.p95 = samples[(size_t)std::ceil(0.95 * n) - 1];
+    return summary;
+}
+
+void BenchResult::add(const string &stage, double ms)
+{
+    if (!samples.count(stage))
+    {
+        stages.push_back(stage);
+    }
+    samples[stage].push_back(ms);
+}
+
+size_t peakResidentBytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+    // Linux reports kilobytes
+    return (size_t)usage.ru_maxrss * 1024;
+}
+
+// Throughput of the kernel stage at its median time
+static double kernelRate(const BenchResult &result, double amount)
+{
+    map<string, vector<double> >::const_iterator kernel =
+        result.samples.find("kernel");
+    if (kernel == result.samples.end())
+    {
+        return 0;
+    }
+    double ms = summarise(kernel->second).median;
+    return ms > 0? amount / (ms * 1e6) : 0;
+}
+
+void printBenchResults(ostream &out, const vector<BenchResult> &results)
+{
+    char line[128];
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &result = results[i];
+        out << "Filter size " << result.filterSize << endl;
+        snprintf(line, sizeof(line), "  %-14s %10s %10s %10s\n",
+                 "stage", "min ms", "median ms", "p95 ms");
+        out << line;
+
+        for (size_t j = 0; j < result.stages.size(); j++)
+        {
+            const string &stage = result.stages[j];
+            StageSummary summary =
+                summarise(result.samples.find(stage)->second);
+            snprintf(line, sizeof(line), "  %-14s %10.3f %10.3f %10.3f\n",
+                     stage.c_str(), summary.min, summary.median,
+                     summary.p95);
+            out << line;
+        }
+
+        snprintf(line, sizeof(line),
+                 "  %0.2f GB/s, %0.2f GFLOP/s\n",
+                 kernelRate(result, result.bytes),
+                 kernelRate(result, result.flops));
+        out << line;
+    }
+
+    snprintf(line, sizeof(line), "Process peak RSS %0.1f MB\n",
+             peakResidentBytes() / (1024.0 * 1024.0));
+    out << line;
+}
+
+static string quote(const string &s)
+{
+    string quoted = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+        {
+            quoted += '\\';
+        }
+        quoted += s[i];
+    }
+    return quoted + "\"";
+}
+
+void writeBenchJson(ostream &out, const map<string, string> &settings,
+                    const vector<BenchResult> &results)
+{
+    out << "{" << endl;
+    map<string, string>::const_iterator it;
+    for (it = settings.begin(); it != settings.end(); it++)
+    {
+        out << "  " << quote(it->first) << ": " << quote(it->second)
+            << "," << endl;
+    }
+
+    out << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &result = results[i];
+        out << "    {" << endl
+            << "      \"filter_size\": " << result.filterSize << "," << endl
+            << "      \"gb_per_s\": " << kernelRate(result, result.bytes)
+            << "," << endl
+            << "      \"gflop_per_s\": " << kernelRate(result, result.flops)
+            << "," << endl
+            << "      \"stages\": {" << endl;
+
+        for (size_t j = 0; j < result.stages.size(); j++)
+        {
+            const string &stage = result.stages[j];
+            StageSummary summary =
+                summarise(result.samples.find(stage)->second);
+            out << "        " << quote(stage) << ": {"
+                << "\"min\": " << summary.min << ", "
+                << "\"median\": " << summary.median << ", "
+                << "\"p95\": " << summary.p95 << "}"
+                << (j + 1 < result.stages.size()? "," : "") << endl;
+        }
+
+        out << "      }" << endl
+            << "    }" << (i + 1 < results.size()? "," : "") << endl;
+    }
+    out << "  ]," << endl
+        << "  \"process_peak_rss_bytes\": " << peakResidentBytes() << endl
+        << "}" << endl;
+}
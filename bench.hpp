@@ -0,0 +1,43 @@
+#ifndef BENCH_HPP_GUARD
+#define BENCH_HPP_GUARD
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Spread of the repeated timings of one stage, in ms
+struct StageSummary
+{
+    double min, median, p95;
+};
+
+StageSummary summarise(std::vector<double> samples);
+
+// Every timing taken for one filter size, stage by stage in the order
+// the stages were first added
+struct BenchResult
+{
+    int filterSize;
+    std::vector<std::string> stages;
+    std::map<std::string, std::vector<double> > samples;
+    // Bytes the kernel has to read and write, and the floating point
+    // operations of the direct convolution, for one run
+    double bytes, flops;
+
+    void add(const std::string &stage, double ms);
+};
+
+// High-water mark of the process's resident memory, in bytes
+size_t peakResidentBytes();
+
+// A table for people and a JSON document for scripts. The JSON starts
+// with the settings the benchmark ran with. Both end with the peak
+// resident memory of the whole process, which is not per filter size.
+void printBenchResults(std::ostream &out,
+                       const std::vector<BenchResult> &results);
+void writeBenchJson(std::ostream &out,
+                    const std::map<std::string, std::string> &settings,
+                    const std::vector<BenchResult> &results);
+
+#endif
@@ -1,208 +1,572 @@
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
 #include "bmp.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+
+// "BM", which every bitmap starts with
+static const WORD BITMAP_TYPE = 0x4d42;
+// Colour tables and newer info headers take a few KB at most, so a longer
+// gap before the pixels is a corrupt header
+static const streamoff MAX_EXTRA_HEADER = 1 << 16;
 
 Bitmap::Bitmap()
-    :fileHeader(new BITMAPFILEHEADER),
-     infoHeader(new BITMAPINFOHEADER),
+    :fileHeader(std::make_shared<BITMAPFILEHEADER>()),
+     infoHeader(std::make_shared<BITMAPINFOHEADER>()),
      extraHeader(),
-     grey(true)
+     grey(true),
+     storage(FLOAT_PIXELS),
+     layout(INTERLEAVED_PIXELS),
+     greyData(NULL)
 {
 }
 
 Bitmap::Bitmap(const Bitmap &rhs)
+    :fileHeader(rhs.fileHeader),
+     infoHeader(rhs.infoHeader),
+     extraHeader(rhs.extraHeader),
+     grey(rhs.grey),
+     storage(rhs.storage),
+     layout(rhs.layout),
+     greyData(NULL)
 {
-    fileHeader = rhs.fileHeader;
-    infoHeader = rhs.infoHeader;
-
-    if (rhs.grey)
+    if (rhs.data())
     {
         size_t size = rhs.infoHeader->biHeight * rhs.infoHeader->biWidth;
-        greyData = new float[size];
-        memcpy(greyData, rhs.greyData, size*sizeof(float));
+        allocate(size);
+        memcpy(data(), rhs.data(), size*planes()*pixelSize());
     }
-    else
+}
+
+Bitmap::Bitmap(Bitmap &&rhs)
+    :fileHeader(rhs.fileHeader),
+     infoHeader(rhs.infoHeader),
+     extraHeader(std::move(rhs.extraHeader)),
+     grey(rhs.grey),
+     storage(rhs.storage),
+     layout(rhs.layout),
+     greyData(rhs.greyData),
+     buffer(std::move(rhs.buffer))
+{
+    rhs.greyData = NULL;
+}
+
+Bitmap & Bitmap::operator=(const Bitmap &rhs)
+{
+    if (this != &rhs)
     {
-        size_t size = rhs.infoHeader->biHeight * rhs.infoHeader->biWidth;
-        colourData = new cl_float4[size];
-        memcpy(colourData, rhs.colourData, size*sizeof(cl_float4));
+        *this = Bitmap(rhs);
     }
+    return *this;
 }
 
-Bitmap & Bitmap::operator=(const Bitmap &rhs)
+Bitmap & Bitmap::operator=(Bitmap &&rhs)
 {
     fileHeader = rhs.fileHeader;
     infoHeader = rhs.infoHeader;
+    extraHeader = std::move(rhs.extraHeader);
+    grey = rhs.grey;
+    storage = rhs.storage;
+    layout = rhs.layout;
+    buffer = std::move(rhs.buffer);
+    greyData = rhs.greyData;
+    rhs.greyData = NULL;
+    return *this;
+}
 
-    if (rhs.grey)
-    {
-        size_t size = rhs.infoHeader->biHeight * rhs.infoHeader->biWidth;
-        greyData = new float[size];
-        memcpy(greyData, rhs.greyData, size*sizeof(float));
-    }
-    else
+size_t Bitmap::pixelSize() const
+{
+    if (storage == BYTE_PIXELS)
     {
-        size_t size = rhs.infoHeader->biHeight * rhs.infoHeader->biWidth;
-        colourData = new cl_float4[size];
-        memcpy(colourData, rhs.colourData, size*sizeof(cl_float4));
+        return singleChannel()? sizeof(unsigned char) : sizeof(cl_uchar4);
     }
+    return singleChannel()? sizeof(float) : sizeof(cl_float4);
+}
 
-    return *this;
+void Bitmap::allocate(size_t pixels)
+{
+    buffer = PooledBuffer(pixels * planes() * pixelSize());
+    buffer.zero();
+    greyData = buffer.as<float>();
 }
 
-void Bitmap::write(string filename)
+void Bitmap::release()
 {
-    ofstream file(filename.c_str());
+    buffer.reset();
+    greyData = NULL;
+}
+
+// For the bmp format, each row has to be a multiple of 4 bytes
+static int rowPadding(int width, int bytesPerPixel)
+{
+    int mod = (width * bytesPerPixel) % 4;
+    return mod == 0? 0 : 4 - mod;
+}
 
-    file.write((char*)(fileHeader), sizeof(BITMAPFILEHEADER));
-    file.write((char*)(infoHeader), sizeof(BITMAPINFOHEADER));
+void Bitmap::writeHeader(ostream &file)
+{
+    file.write((char*)(fileHeader.get()), sizeof(BITMAPFILEHEADER));
+    file.write((char*)(infoHeader.get()), sizeof(BITMAPINFOHEADER));
     file.write((char*)(&extraHeader[0]), extraHeader.size());
+}
 
-    cout << "Saving filtered image to " << filename << endl;
+bool Bitmap::readHeader(istream &file)
+{
+    file.read((char*)fileHeader.get(), sizeof(BITMAPFILEHEADER));
+    file.read((char*)infoHeader.get(), sizeof(BITMAPINFOHEADER));
 
-    int height = infoHeader->biHeight;
-    int width = infoHeader->biWidth;
+    int bitCount = infoHeader->biBitCount;
+    if (!file || fileHeader->bfType != BITMAP_TYPE
+        || infoHeader->biWidth <= 0 || infoHeader->biHeight <= 0
+        || (bitCount != 8 && bitCount != 24 && bitCount != 32)
+        || fileHeader->bfOffBits < file.tellg()
+        || fileHeader->bfOffBits - file.tellg() > MAX_EXTRA_HEADER)
+    {
+        return false;
+    }
 
-    int mod = width % 4;
-    if(mod != 0) {
-        mod = 4 - mod;
+    //check if there is extra information, like a colour table
+    if (file.tellg() != fileHeader->bfOffBits)
+    {
+        size_t tableSize = fileHeader->bfOffBits - file.tellg();
+        extraHeader.resize(tableSize);
+        file.read(&extraHeader[0], tableSize);
     }
 
+    grey = infoHeader->biBitCount == 8;
+    return (bool)file;
+}
 
-    if(grey)
+// Conversions between a row of bmp pixel bytes and a row of floats.
+// These are simple enough for the compiler to vectorise.
+static void unpackRow(const unsigned char *src, float *dest, int width,
+                      int /*bytesPerPixel*/)
+{
+    for (int j = 0; j < width; j++)
     {
-        char tmp;
-        char junk = 0;
-        for(int i = 0; i < height; i++) {
-            // add actual data to the image
-            for(int j = 0; j < width; j++) {
-                tmp = (unsigned char)greyData[i*width + j];
-                file.write(&tmp, 1);
-            }
-            // For the bmp format, each row has to be a multiple of 4,
-            // so I need to read in the junk data and throw it away
-            for(int j = 0; j < mod; j++) {
-                file.write(&junk, 1);
-            }
-        }
+        dest[j] = src[j];
     }
-    else
+}
+
+static void unpackRow(const unsigned char *src, cl_float4 *dest, int width,
+                      int bytesPerPixel)
+{
+    bool alpha = bytesPerPixel == 4;
+    for (int j = 0; j < width; j++, src += bytesPerPixel)
     {
-        char tmp;
-        char junk = 0;
-        cl_float4 *elt;
-        bool alpha = infoHeader->biBitCount == 32;
-        for(int i = 0; i < height; i++) {
-            // add actual data to the image
-            for(int j = 0; j < width; j++) {
-                elt = &colourData[i*width + j];
-                tmp = (unsigned char)elt->x;
-                file.write(&tmp, 1);
-                tmp = (unsigned char)elt->y;
-                file.write(&tmp, 1);
-                tmp = (unsigned char)elt->z;
-                file.write(&tmp, 1);
-                if (alpha)
-                {
-                    //tmp = (unsigned char)elt->w;
-                    tmp = (unsigned char)0;
-                    file.write(&tmp,1);
-                }
-            }
-            // For the bmp format, each row has to be a multiple of 4,
-            // so I need to read in the junk data and throw it away
-            for(int j = 0; j < mod; j++) {
-                file.write(&junk, 1);
-            }
-        }
+        dest[j].x = src[0];
+        dest[j].y = src[1];
+        dest[j].z = src[2];
+        dest[j].w = alpha? src[3] : 0;
     }
 }
 
-void Bitmap::read(string filename)
+static void unpackRow(const unsigned char *src, unsigned char *dest,
+                      int width, int /*bytesPerPixel*/)
 {
-    ifstream file;
-    file.open(filename.c_str());
+    memcpy(dest, src, width);
+}
 
-    if (file) {
-        file.read((char*)fileHeader, sizeof(BITMAPFILEHEADER));
-        file.read((char*)infoHeader, sizeof(BITMAPINFOHEADER));
+static void unpackRow(const unsigned char *src, cl_uchar4 *dest, int width,
+                      int bytesPerPixel)
+{
+    bool alpha = bytesPerPixel == 4;
+    for (int j = 0; j < width; j++, src += bytesPerPixel)
+    {
+        dest[j].x = src[0];
+        dest[j].y = src[1];
+        dest[j].z = src[2];
+        dest[j].w = alpha? src[3] : 0;
+    }
+}
 
-        int height = infoHeader->biHeight;
-        int width = infoHeader->biWidth;
+static void packRow(const float *src, unsigned char *dest, int width,
+                    int /*bytesPerPixel*/)
+{
+    for (int j = 0; j < width; j++)
+    {
+        dest[j] = (unsigned char)src[j];
+    }
+}
 
-        cout << "Using input file " << filename << endl;
-        cout << "Dimensions: " << height << 'x' << width << endl;
+static void packRow(const cl_float4 *src, unsigned char *dest, int width,
+                    int bytesPerPixel)
+{
+    bool alpha = bytesPerPixel == 4;
+    for (int j = 0; j < width; j++, dest += bytesPerPixel)
+    {
+        dest[0] = (unsigned char)src[j].x;
+        dest[1] = (unsigned char)src[j].y;
+        dest[2] = (unsigned char)src[j].z;
+        if (alpha)
+        {
+            dest[3] = 0;
+        }
+    }
+}
+
+static void packRow(const unsigned char *src, unsigned char *dest,
+                    int width, int /*bytesPerPixel*/)
+{
+    memcpy(dest, src, width);
+}
 
-        int mod = width % 4;
-        if(mod != 0) {
-            mod = 4 - mod;
+static void packRow(const cl_uchar4 *src, unsigned char *dest, int width,
+                    int bytesPerPixel)
+{
+    bool alpha = bytesPerPixel == 4;
+    for (int j = 0; j < width; j++, dest += bytesPerPixel)
+    {
+        dest[0] = src[j].x;
+        dest[1] = src[j].y;
+        dest[2] = src[j].z;
+        if (alpha)
+        {
+            dest[3] = 0;
+        }
+    }
+}
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile(const string &filename)
+        : data(NULL), size(0)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            size = info.st_size;
+            void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = mapped == MAP_FAILED? NULL : (const unsigned char*)mapped;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
         }
+    }
 
-        //check if there is extra information, like a colour table
-        if (file.tellg() != fileHeader->bfOffBits)
+    ~MappedFile()
+    {
+        if (data)
         {
-            size_t tableSize = fileHeader->bfOffBits - file.tellg();
-            extraHeader.resize(tableSize);
-            file.read(&extraHeader[0], tableSize);
+            munmap((void*)data, size);
         }
+    }
+
+    const unsigned char *data;
+    size_t size;
+};
 
-        if (infoHeader->biBitCount == 8)
+template <class T>
+static void packImage(const T *src, unsigned char *dest,
+                      int width, int height, int bytesPerPixel)
+{
+    size_t stride = width * bytesPerPixel + rowPadding(width, bytesPerPixel);
+    parallelRows(height, [=](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
         {
-            grey = true;
+            packRow(src + (size_t)i * width, dest + i * stride,
+                    width, bytesPerPixel);
+        }
+    });
+}
 
-            greyData = new float[height*width];
+template <class T>
+static void unpackImage(const unsigned char *src, T *dest,
+                        int width, int height, int bytesPerPixel)
+{
+    size_t stride = width * bytesPerPixel + rowPadding(width, bytesPerPixel);
+    parallelRows(height, [=](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            unpackRow(src + i * stride, dest + (size_t)i * width,
+                      width, bytesPerPixel);
+        }
+    });
+}
 
-            char tmp;
-            for(int i = 0; i < height; i++)
+// Planar images spread each pixel's channels over three planes of
+// planeSize elements. The alpha channel of 32-bit images is not kept.
+template <class T>
+static void packPlanes(const T *src, unsigned char *dest,
+                       int width, int height, int bytesPerPixel)
+{
+    size_t stride = width * bytesPerPixel + rowPadding(width, bytesPerPixel);
+    size_t planeSize = (size_t)width * height;
+    parallelRows(height, [=](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            const T *row = src + (size_t)i * width;
+            unsigned char *pixel = dest + i * stride;
+            for (int j = 0; j < width; j++, pixel += bytesPerPixel)
             {
-                for(int j = 0; j < width; j++) {
-                    file.read(&tmp,1);
-                    greyData[i*width + j] = (float)(unsigned char)tmp;
-                }
-                // For the bmp format, each row has to be a multiple of 4,
-                // so I need to read in the junk data and throw it away
-                for(int j = 0; j < mod; j++)
+                pixel[0] = (unsigned char)row[j];
+                pixel[1] = (unsigned char)row[j + planeSize];
+                pixel[2] = (unsigned char)row[j + planeSize*2];
+                if (bytesPerPixel == 4)
                 {
-                    file.read(&tmp,1);
+                    pixel[3] = 0;
                 }
             }
         }
+    });
+}
+
+template <class T>
+static void unpackPlanes(const unsigned char *src, T *dest,
+                         int width, int height, int bytesPerPixel)
+{
+    size_t stride = width * bytesPerPixel + rowPadding(width, bytesPerPixel);
+    size_t planeSize = (size_t)width * height;
+    parallelRows(height, [=](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            T *row = dest + (size_t)i * width;
+            const unsigned char *pixel = src + i * stride;
+            for (int j = 0; j < width; j++, pixel += bytesPerPixel)
+            {
+                row[j] = pixel[0];
+                row[j + planeSize] = pixel[1];
+                row[j + planeSize*2] = pixel[2];
+            }
+        }
+    });
+}
+
+void Bitmap::write(string filename)
+{
+    TraceSpan span("write bitmap");
+    ofstream file(filename.c_str(), ios::binary);
+    if (!file)
+    {
+        throw runtime_error("File " + filename + " could not be written");
+    }
+
+    writeHeader(file);
+
+    logLine("Saving filtered image to " + filename);
+
+    int height = infoHeader->biHeight;
+    int width = infoHeader->biWidth;
+    int bytesPerPixel = infoHeader->biBitCount / 8;
+
+    // Convert the whole image in parallel and write it in one go
+    size_t stride = width * bytesPerPixel + rowPadding(width, bytesPerPixel);
+    PooledBuffer encoded(stride * height);
+    encoded.zero();
+    unsigned char *pixels = encoded.as<unsigned char>();
+
+    if (planes() > 1)
+    {
+        if (storage == BYTE_PIXELS)
+            packPlanes(greyBytes, pixels, width, height, bytesPerPixel);
+        else
+            packPlanes(greyData, pixels, width, height, bytesPerPixel);
+    }
+    else if (storage == BYTE_PIXELS)
+    {
+        if (grey)
+            packImage(greyBytes, pixels, width, height, bytesPerPixel);
+        else
+            packImage(colourBytes, pixels, width, height, bytesPerPixel);
+    }
+    else
+    {
+        if (grey)
+            packImage(greyData, pixels, width, height, bytesPerPixel);
+        else
+            packImage(colourData, pixels, width, height, bytesPerPixel);
+    }
+
+    file.write((char*)pixels, encoded.size());
+    file.close();
+    if (!file)
+    {
+        throw runtime_error("File " + filename + " could not be written");
+    }
+}
+
+void Bitmap::read(string filename)
+{
+    TraceSpan span("read bitmap");
+    ifstream file(filename.c_str(), ios::binary);
+
+    if (!file)
+    {
+        throw runtime_error("File " + filename + " could not be read");
+    }
+    if (!readHeader(file))
+    {
+        throw runtime_error("File " + filename + " is not a bitmap");
+    }
+    file.close();
+
+    int height = infoHeader->biHeight;
+    int width = infoHeader->biWidth;
+    int bytesPerPixel = infoHeader->biBitCount / 8;
+
+    logLine("Using input file " + filename);
+    logLine("Dimensions: " + to_string(height) + 'x' + to_string(width));
+
+    // Map the file and convert its rows in parallel straight from the
+    // page cache
+    MappedFile mapped(filename);
+    size_t stride = (size_t)width * bytesPerPixel
+        + rowPadding(width, bytesPerPixel);
+    if (!mapped.data || mapped.size < fileHeader->bfOffBits + stride*height)
+    {
+        throw runtime_error("File " + filename + " is truncated");
+    }
+    const unsigned char *pixels = mapped.data + fileHeader->bfOffBits;
+
+    allocate((size_t)height*width);
+    if (planes() > 1)
+    {
+        if (storage == BYTE_PIXELS)
+            unpackPlanes(pixels, greyBytes, width, height, bytesPerPixel);
+        else
+            unpackPlanes(pixels, greyData, width, height, bytesPerPixel);
+    }
+    else if (storage == BYTE_PIXELS)
+    {
+        if (grey)
+            unpackImage(pixels, greyBytes, width, height, bytesPerPixel);
         else
+            unpackImage(pixels, colourBytes, width, height, bytesPerPixel);
+    }
+    else
+    {
+        if (grey)
+            unpackImage(pixels, greyData, width, height, bytesPerPixel);
+        else
+            unpackImage(pixels, colourData, width, height, bytesPerPixel);
+    }
+}
+
+BitmapReader::BitmapReader(string filename)
+    : filename(filename), file(filename.c_str(), ios::binary)
+{
+    if (!file)
+    {
+        throw runtime_error("File " + filename + " could not be read");
+    }
+    if (!header.readHeader(file))
+    {
+        throw runtime_error("File " + filename + " is not a bitmap");
+    }
+
+    logLine("Streaming input file " + filename);
+    logLine("Dimensions: " + to_string(height()) + 'x' + to_string(width()));
+
+    int bytesPerPixel = header.infoHeader->biBitCount / 8;
+    row.resize(width() * bytesPerPixel + rowPadding(width(), bytesPerPixel));
+}
+
+template <class T>
+static void readRows(istream &file, const string &filename,
+                     vector<unsigned char> &row, int count, T *dest,
+                     int width, int bytesPerPixel)
+{
+    for (int i = 0; i < count; i++, dest += width)
+    {
+        if (!file.read((char*)&row[0], row.size()))
         {
-            grey = false;
+            throw runtime_error("File " + filename + " is truncated");
+        }
+        unpackRow(&row[0], dest, width, bytesPerPixel);
+    }
+}
 
-            colourData = new cl_float4[height*width];
+void BitmapReader::readRows(int count, float *dest)
+{
+    ::readRows(file, filename, row, count, dest, width(),
+               header.infoHeader->biBitCount / 8);
+}
 
-            cl_float4 *elt;
-            char tmp;
-            bool alpha = infoHeader->biBitCount == 32;
-            for(int i = 0; i < height; i++)
-            {
-                for(int j = 0; j < width; j++) {
-                    elt = &colourData[i*width + j];
-                    file.read(&tmp,1);
-                    elt->x = (float)(unsigned char)tmp;
-                    file.read(&tmp,1);
-                    elt->y = (float)(unsigned char)tmp;
-                    file.read(&tmp,1);
-                    elt->z = (float)(unsigned char)tmp;
-                    if (alpha)
-                    {
-                        file.read(&tmp,1);
-                        elt->w = (float)(unsigned char)tmp;
-                    }
-                }
-                // For the bmp format, each row has to be a multiple of 4,
-                // so I need to read in the junk data and throw it away
-                for(int j = 0; j < mod; j++)
-                {
-                    file.read(&tmp,1);
-                }
-            }
+void BitmapReader::readRows(int count, cl_float4 *dest)
+{
+    ::readRows(file, filename, row, count, dest, width(),
+               header.infoHeader->biBitCount / 8);
+}
+
+void BitmapReader::readRows(int count, unsigned char *dest)
+{
+    ::readRows(file, filename, row, count, dest, width(),
+               header.infoHeader->biBitCount / 8);
+}
+
+void BitmapReader::readRows(int count, cl_uchar4 *dest)
+{
+    ::readRows(file, filename, row, count, dest, width(),
+               header.infoHeader->biBitCount / 8);
+}
+
+BitmapWriter::BitmapWriter(string filename, Bitmap &header)
+    : filename(filename),
+      file(filename.c_str(), ios::binary),
+      width(header.infoHeader->biWidth),
+      bytesPerPixel(header.infoHeader->biBitCount / 8)
+{
+    if (!file)
+    {
+        throw runtime_error("File " + filename + " could not be written");
+    }
+    header.writeHeader(file);
+
+    logLine("Streaming filtered image to " + filename);
+
+    row.resize(width * bytesPerPixel + rowPadding(width, bytesPerPixel));
+}
+
+template <class T>
+static void writeRows(ostream &file, const string &filename,
+                      vector<unsigned char> &row, int count, const T *src,
+                      int width, int bytesPerPixel)
+{
+    for (int i = 0; i < count; i++, src += width)
+    {
+        packRow(src, &row[0], width, bytesPerPixel);
+        if (!file.write((char*)&row[0], row.size()))
+        {
+            throw runtime_error("File " + filename + " could not be written");
         }
     }
 }
+
+void BitmapWriter::writeRows(int count, const float *src)
+{
+    ::writeRows(file, filename, row, count, src, width, bytesPerPixel);
+}
+
+void BitmapWriter::writeRows(int count, const cl_float4 *src)
+{
+    ::writeRows(file, filename, row, count, src, width, bytesPerPixel);
+}
+
+void BitmapWriter::writeRows(int count, const unsigned char *src)
+{
+    ::writeRows(file, filename, row, count, src, width, bytesPerPixel);
+}
+
+void BitmapWriter::writeRows(int count, const cl_uchar4 *src)
+{
+    ::writeRows(file, filename, row, count, src, width, bytesPerPixel);
+}
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <CL/cl.hpp>
+#include <memory>
 #include <string>
 #include <vector>
+#include <fstream>
+
+#include "pool.hpp"
 typedef int LONG;
 typedef unsigned short WORD;
 typedef unsigned int DWORD;
@@ -32,24 +36,121 @@ typedef struct tagBITMAPINFOHEADER {
 
 #pragma pack(pop)
 
+// How pixels are held in memory. Float pixels are what the kernels
+// compute in; byte pixels hold the bmp data as is and are widened to
+// float only while a filter runs.
+enum PixelStorage
+{
+    FLOAT_PIXELS,
+    BYTE_PIXELS
+};
+
+// How colour channels are arranged. Interleaved pixels keep all of a
+// pixel's channels together; planar images hold one plane per channel,
+// each of which can be filtered like a grey image.
+enum PixelLayout
+{
+    INTERLEAVED_PIXELS,
+    PLANAR_PIXELS
+};
+
+// Pixel data lives in a pooled buffer owned by the bitmap. Copies copy
+// the pixels, moves take them over, and either way the headers are shared
+// between the two, as an image and the filtered image have the same ones.
 struct Bitmap
 {
 public:
     Bitmap();
     Bitmap(const Bitmap &rhs);
+    Bitmap(Bitmap &&rhs);
     Bitmap & operator=(const Bitmap &rhs);
+    Bitmap & operator=(Bitmap &&rhs);
 
-    PBITMAPFILEHEADER fileHeader;
-    PBITMAPINFOHEADER infoHeader;
+    std::shared_ptr<BITMAPFILEHEADER> fileHeader;
+    std::shared_ptr<BITMAPINFOHEADER> infoHeader;
     std::vector<char> extraHeader;
     bool grey;
+    PixelStorage storage;
+    PixelLayout layout;
 
+    // Planar colour images are held as three grey planes, one after the
+    // other. pixelSize is then the size of one channel of one pixel.
+    bool singleChannel() const {return grey || layout == PLANAR_PIXELS;}
+    int planes() const {return grey? 1 : layout == PLANAR_PIXELS? 3 : 1;}
+
+    // Bytes per pixel for the current colour mode and storage
+    size_t pixelSize() const;
+    void *data() const {return greyData;}
+
+    // Zero-initialised pixel data of the right type for this many pixels
+    // in every plane, and its return to the pool
+    void allocate(size_t pixels);
+    void release();
+
+    // Files that cannot be written throw std::runtime_error naming the file
     void write(std::string filename);
+    // Files that cannot be opened, are not 8, 24 or 32 bit bitmaps or are
+    // truncated throw std::runtime_error naming the file
     void read(std::string filename);
 
+    // Headers only, for readers and writers that stream the pixel data.
+    // readHeader returns false for a header it cannot read.
+    void writeHeader(std::ostream &file);
+    bool readHeader(std::istream &file);
+
     union
     {
         cl_float4 *colourData;
         float *greyData;
+        cl_uchar4 *colourBytes;
+        unsigned char *greyBytes;
     };
+
+private:
+    PooledBuffer buffer;
+};
+
+// Reads the pixel data of a bitmap a few rows at a time, so that images
+// larger than memory can be processed in strips
+class BitmapReader
+{
+public:
+    // Throws std::runtime_error as Bitmap::read does
+    BitmapReader(std::string filename);
+
+    Bitmap header;
+    int width() const {return header.infoHeader->biWidth;}
+    int height() const {return header.infoHeader->biHeight;}
+
+    // Reads the next count rows, throwing std::runtime_error if the file
+    // ends first
+    void readRows(int count, float *dest);
+    void readRows(int count, cl_float4 *dest);
+    void readRows(int count, unsigned char *dest);
+    void readRows(int count, cl_uchar4 *dest);
+
+private:
+    std::string filename;
+    std::ifstream file;
+    std::vector<unsigned char> row;
+};
+
+// Writes a bitmap with the given headers a few rows at a time. Files that
+// cannot be written throw std::runtime_error naming the file.
+class BitmapWriter
+{
+public:
+    BitmapWriter(std::string filename, Bitmap &header);
+
+    void writeRows(int count, const float *src);
+    void writeRows(int count, const cl_float4 *src);
+    void writeRows(int count, const unsigned char *src);
+    void writeRows(int count, const cl_uchar4 *src);
+
+private:
+    std::string filename;
+    std::ofstream file;
+    std::vector<unsigned char> row;
+    int width;
+    int bytesPerPixel;
 };
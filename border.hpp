@@ -0,0 +1,47 @@
+#ifndef BORDER_HPP_GUARD
+#define BORDER_HPP_GUARD
+
+#include <cstdlib>
+
+// What filters see outside the image. The values match BORDER in the
+// kernels.
+enum BorderMode
+{
+    ZERO_BORDER,
+    CLAMP_BORDER,
+    MIRROR_BORDER,
+    WRAP_BORDER
+};
+
+// Maps a row or column index into [0,n), or to -1 where the pixel reads
+// as zero. Mirroring reflects about the edge pixel without repeating it,
+// the same as borderIndex in the kernels.
+inline int borderIndex(int i, int n, BorderMode border)
+{
+    if (i >= 0 && i < n)
+    {
+        return i;
+    }
+
+    switch (border)
+    {
+    case CLAMP_BORDER:
+        return i < 0? 0 : n - 1;
+    case MIRROR_BORDER:
+    {
+        if (n == 1)
+        {
+            return 0;
+        }
+        int period = 2 * (n - 1);
+        i = std::abs(i) % period;
+        return i < n? i : period - i;
+    }
+    case WRAP_BORDER:
+        return (i % n + n) % n;
+    default:
+        return -1;
+    }
+}
+
+#endif
@@ -0,0 +1,393 @@
+#include "box.hpp"
+#include "parallel.hpp"
+#include "pool.hpp"
+
+#include <algorithm>
+
+// Rows summed together along horizontal lines
+static const int ROW_BLOCK = 8;
+
+// Smallest boxes the running sums beat the tap loops on, measured on a
+// 1920x1080 image. Squares take two passes and an intermediate image
+// against the separable loops, while the dense loops run every tap of a
+// diagonal's square.
+static const int MIN_SQUARE_BOX = 17;
+static const int MIN_LINE_BOX = 9;
+static const int MIN_DIAGONAL_BOX = 5;
+
+static inline float clampPixel(float val)
+{
+    return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+bool findBoxShape(const Filter *filter, BoxShape &shape)
+{
+    static const BoxShape shapes[] =
+    {
+        {true, 0, 0}, {false, 0, 1}, {false, 1, 0}, {false, 1, 1},
+        {false, 1, -1}
+    };
+
+    int size = filter->size();
+    int radius = size/2;
+    if (size < 3)
+    {
+        return false;
+    }
+
+    for (size_t s = 0; s < sizeof(shapes)/sizeof(shapes[0]); s++)
+    {
+        bool matches = true;
+        for (int fy = 0; fy < size && matches; fy++)
+        {
+            for (int fx = 0; fx < size && matches; fx++)
+            {
+                int dy = fy - radius;
+                int dx = fx - radius;
+                bool onLine = shapes[s].square ||
+                    dy*shapes[s].columnStep == dx*shapes[s].rowStep;
+                matches = filter->filter()[fy*size + fx] == (onLine? 1 : 0);
+            }
+        }
+        if (matches)
+        {
+            shape = shapes[s];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool boxIsFaster(const Filter *filter, const BoxShape &shape)
+{
+    int size = filter->size();
+    if (shape.square)
+    {
+        return size >= MIN_SQUARE_BOX;
+    }
+    if (shape.rowStep == 0 || shape.columnStep == 0)
+    {
+        return size >= MIN_LINE_BOX;
+    }
+    return size >= MIN_DIAGONAL_BOX;
+}
+
+// Where a box pass reads from and writes to, laid out like Pass in
+// cpu_convolution.cpp. The window is a line of radius*2 + 1 taps.
+template <class In, class Out>
+struct BoxPass
+{
+    const In *input;
+    Out *output;
+    int width, height, haloRows, channels;
+    int radius, rowStep, columnStep;
+    float factor, bias;
+    bool clamp;
+    BorderMode border;
+};
+
+// Channels is the pixel's channel count, fixed so the loops over it unroll
+template <class In, class Out, int Channels>
+class LineSums
+{
+public:
+    explicit LineSums(const BoxPass<In, Out> &p)
+        : p(p), rowLength(p.width * Channels),
+          inputHeight(p.height + p.haloRows*2),
+          reach(p.radius + 1),
+          columnMap((p.width + reach*2) * sizeof(int))
+    {
+        // Every column the window reaches, mapped through the border
+        // mode once
+        int *map = columnMap.as<int>();
+        for (int i = 0; i < p.width + reach*2; i++)
+        {
+            map[i] = borderIndex(i - reach, p.width, p.border);
+        }
+        columns = map + reach;
+    }
+
+    // Output rows [rowBegin, rowEnd). Horizontal lines run along each row
+    // and the others from the row above, so only the first row of the
+    // band and the ends of each row sum the whole window.
+    void run(int rowBegin, int rowEnd)
+    {
+        if (p.rowStep == 0)
+        {
+            PooledBuffer sums(rowLength * ROW_BLOCK * sizeof(float));
+            for (int y = rowBegin; y < rowEnd; y += ROW_BLOCK)
+            {
+                sumAlongRows(y, std::min(y + ROW_BLOCK, rowEnd),
+                             sums.as<float>());
+            }
+            return;
+        }
+
+        PooledBuffer sums(rowLength * 2 * sizeof(float));
+        float *previous = sums.as<float>();
+        float *current = previous + rowLength;
+        for (int y = rowBegin; y < rowEnd; y++)
+        {
+            if (y == rowBegin)
+            {
+                for (int x = 0; x < p.width; x++)
+                {
+                    windowSums(y, x, &current[x * Channels]);
+                }
+            }
+            else
+            {
+                sumFromRowAbove(y, previous, current);
+            }
+            store(y, current);
+            std::swap(previous, current);
+        }
+    }
+
+private:
+    const BoxPass<In, Out> &p;
+    int rowLength, inputHeight, reach;
+    PooledBuffer columnMap;
+    const int *columns;
+
+    // Input row of output row y, or NULL where the border reads as zero
+    const In *inputRow(int y) const
+    {
+        int row = borderIndex(y + p.haloRows, inputHeight, p.border);
+        return row < 0? NULL : p.input + (size_t)row * rowLength;
+    }
+
+    // Adds channel values of the tap at column x of row to sums
+    void addTap(const In *row, int x, float *sums, float sign) const
+    {
+        int col = columns[x];
+        if (row == NULL || col < 0)
+        {
+            return;
+        }
+        for (int c = 0; c < Channels; c++)
+        {
+            sums[c] += sign * row[col * Channels + c];
+        }
+    }
+
+    void windowSums(int y, int x, float *sums) const
+    {
+        for (int c = 0; c < Channels; c++)
+        {
+            sums[c] = 0;
+        }
+        for (int i = -p.radius; i <= p.radius; i++)
+        {
+            addTap(inputRow(y + i*p.rowStep), x + i*p.columnStep, sums, 1);
+        }
+    }
+
+    // Rows are summed ROW_BLOCK at a time, interleaved, so that the chain
+    // of additions along each row overlaps those along the others
+    void sumAlongRows(int rowBegin, int rowEnd, float *sums) const
+    {
+        int rows = rowEnd - rowBegin;
+        const In *row[ROW_BLOCK];
+        bool inside = true;
+        for (int j = 0; j < rows; j++)
+        {
+            row[j] = inputRow(rowBegin + j);
+            inside = inside && row[j] != NULL;
+            windowSums(rowBegin + j, 0, &sums[j * rowLength]);
+        }
+
+        // Where both taps lie inside the rows, which needs no border checks
+        int begin = std::min(p.radius + 1, p.width);
+        int end = inside? std::max(p.width - p.radius, begin) : begin;
+
+        for (int x = 1; x < begin; x++)
+        {
+            stepAlongRows(row, rows, x, sums);
+        }
+        for (int x = begin; x < end; x++)
+        {
+            for (int j = 0; j < rows; j++)
+            {
+                float *sum = &sums[j * rowLength + x * Channels];
+                const In *in = row[j] + (x + p.radius) * Channels;
+                const In *out = row[j] + (x - p.radius - 1) * Channels;
+                for (int c = 0; c < Channels; c++)
+                {
+                    sum[c] = sum[c - Channels] + in[c] - out[c];
+                }
+            }
+        }
+        for (int x = end; x < p.width; x++)
+        {
+            stepAlongRows(row, rows, x, sums);
+        }
+
+        for (int j = 0; j < rows; j++)
+        {
+            store(rowBegin + j, &sums[j * rowLength]);
+        }
+    }
+
+    void stepAlongRows(const In **row, int rows, int x, float *sums) const
+    {
+        for (int j = 0; j < rows; j++)
+        {
+            float *sum = &sums[j * rowLength + x * Channels];
+            for (int c = 0; c < Channels; c++)
+            {
+                sum[c] = sum[c - Channels];
+            }
+            addTap(row[j], x + p.radius, sum, 1);
+            addTap(row[j], x - p.radius - 1, sum, -1);
+        }
+    }
+
+    // Each sum is the one up and back along the line from it, plus the
+    // tap now entering the window and minus the one leaving it
+    void sumFromRowAbove(int y, const float *previous, float *current) const
+    {
+        int step = p.columnStep;
+        const In *entering = inputRow(y + p.radius);
+        const In *leaving = inputRow(y - p.radius - 1);
+
+        // Where the previous sum and both taps lie inside the row
+        int begin = 0, end = p.width;
+        int offsets[] = {-step, p.radius*step, -(p.radius + 1)*step};
+        for (int i = 0; i < 3; i++)
+        {
+            begin = std::max(begin, -offsets[i]);
+            end = std::min(end, p.width - offsets[i]);
+        }
+        if (entering == NULL || leaving == NULL || begin >= end)
+        {
+            begin = end = 0;
+        }
+
+        for (int x = 0; x < p.width; x++)
+        {
+            if (x == begin && begin < end)
+            {
+                // The vector loop, without border checks
+                int ch = Channels;
+                const float *from = &previous[(begin - step) * ch];
+                const In *in = entering + (begin + p.radius*step) * ch;
+                const In *out = leaving
+                    + (begin - (p.radius + 1)*step) * ch;
+                float *to = &current[begin * ch];
+                for (int i = 0; i < (end - begin) * ch; i++)
+                {
+                    to[i] = from[i] + in[i] - out[i];
+                }
+                x = end - 1;
+                continue;
+            }
+
+            float *sum = &current[x * Channels];
+            int above = x - step;
+            if (above < 0 || above >= p.width)
+            {
+                windowSums(y, x, sum);
+                continue;
+            }
+            for (int c = 0; c < Channels; c++)
+            {
+                sum[c] = previous[above * Channels + c];
+            }
+            addTap(entering, x + p.radius*step, sum, 1);
+            addTap(leaving, x - (p.radius + 1)*step, sum, -1);
+        }
+    }
+
+    void store(int y, const float *sums) const
+    {
+        Out *out = p.output + (size_t)y * rowLength;
+        for (int i = 0; i < rowLength; i++)
+        {
+            float val = sums[i] * p.factor + p.bias;
+            out[i] = (Out)(p.clamp? clampPixel(val) : val);
+        }
+    }
+};
+
+template <class In, class Out>
+static void sumLines(const BoxPass<In, Out> &p)
+{
+    parallelRows(p.height, [&p](int rowBegin, int rowEnd)
+    {
+        if (p.channels == 4)
+            LineSums<In, Out, 4>(p).run(rowBegin, rowEnd);
+        else
+            LineSums<In, Out, 1>(p).run(rowBegin, rowEnd);
+    });
+}
+
+template <class T>
+static void convolve(const T *input, T *output, int width, int height,
+                     int haloRows, int channels, const Filter *filter,
+                     const BoxShape &shape, BorderMode border)
+{
+    int radius = filter->size()/2;
+
+    if (shape.square)
+    {
+        // Rows then columns, the same split as separable filters
+        int inputHeight = height + haloRows*2;
+        PooledBuffer buffer((size_t)inputHeight * width * channels
+                            * sizeof(float));
+        float *intermediate = buffer.as<float>();
+
+        BoxPass<T, float> rows = {input, intermediate, width,
+                                  inputHeight, 0, channels, radius, 0, 1,
+                                  1, 0, false, border};
+        sumLines(rows);
+
+        BoxPass<float, T> columns = {intermediate, output, width, height,
+                                     haloRows, channels, radius, 1, 0,
+                                     filter->factor(), filter->bias(), true,
+                                     border};
+        sumLines(columns);
+        return;
+    }
+
+    BoxPass<T, T> line = {input, output, width, height, haloRows, channels,
+                          radius, shape.rowStep, shape.columnStep,
+                          filter->factor(), filter->bias(), true, border};
+    sumLines(line);
+}
+
+void boxConvolve(const float *input, float *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border)
+{
+    convolve(input, output, width, height, haloRows, 1, filter, shape,
+             border);
+}
+
+void boxConvolve(const cl_float4 *input, cl_float4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border)
+{
+    convolve((const float*)input, (float*)output,
+             width, height, haloRows, 4, filter, shape, border);
+}
+
+void boxConvolve(const unsigned char *input, unsigned char *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border)
+{
+    convolve(input, output, width, height, haloRows, 1, filter, shape,
+             border);
+}
+
+void boxConvolve(const cl_uchar4 *input, cl_uchar4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border)
+{
+    convolve((const unsigned char*)input, (unsigned char*)output,
+             width, height, haloRows, 4, filter, shape, border);
+}
@@ -0,0 +1,52 @@
+#ifndef BOX_HPP_GUARD
+#define BOX_HPP_GUARD
+
+#include <CL/cl.hpp>
+#include "filters.hpp"
+#include "border.hpp"
+
+// A filter whose taps are all one, either across the whole square or
+// along a line through its centre, as every blur is. Each output pixel's
+// sum is then its neighbour's plus the tap entering the window and minus
+// the one leaving it, so the cost per pixel does not grow with the size.
+struct BoxShape
+{
+    bool square;
+    // Offset between neighbouring taps of a line: 0,1 is horizontal,
+    // 1,0 vertical and 1,1 and 1,-1 the two diagonals
+    int rowStep, columnStep;
+};
+
+// Whether the filter is a box, and its shape if it is. Single taps gain
+// nothing from running sums and are not boxes.
+bool findBoxShape(const Filter *filter, BoxShape &shape);
+
+// Whether running sums beat the tap loops for a box of this shape. Small
+// boxes are cheaper through the unrolled loops.
+bool boxIsFaster(const Filter *filter, const BoxShape &shape);
+
+// The same filtering as cpuConvolve, with the same arguments, for box
+// filters. Sums run in float along each band of rows, which is exact for
+// byte pixels in boxes up to 255 x 255 and drifts by around 1e-3 over
+// thousands of rows of float pixels.
+void boxConvolve(const float *input, float *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border);
+
+void boxConvolve(const cl_float4 *input, cl_float4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border);
+
+void boxConvolve(const unsigned char *input, unsigned char *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border);
+
+void boxConvolve(const cl_uchar4 *input, cl_uchar4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, const BoxShape &shape,
+                 BorderMode border);
+
+#endif
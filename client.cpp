@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "serve.hpp"
+#include "bmp.hpp"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace po = boost::program_options;
+
+// Reads a reply, and its payload into data if it is OK. The reply line is
+// left in status.
+static bool readReply(int fd, string &status, vector<char> &data)
+{
+    if (!readLine(fd, status))
+    {
+        return false;
+    }
+    data.clear();
+    if (boost::starts_with(status, "OK "))
+    {
+        data.resize(std::stoul(status.substr(3)));
+        return data.empty() || readBytes(fd, &data[0], data.size());
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    string socketPath, inputFile, outputFile;
+    vector<string> filters;
+    int repeat;
+    bool stats;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "show this help message")
+        ("socket,s",
+         po::value<string>(&socketPath)->default_value("convolution.sock"),
+         "the socket convolution --serve listens on")
+        ("input-file,i", po::value<string>(&inputFile),
+         "image to send")
+        ("output-file,o",
+         po::value<string>(&outputFile)->default_value("output.bmp"),
+         "where to write the filtered image")
+        ("filter,f", po::value<vector<string> >(&filters)->composing(),
+         "filter to run on the image, as for convolution")
+        ("repeat,r", po::value<int>(&repeat)->default_value(1),
+         "times to send the image, each timed")
+        ("stats", po::bool_switch(&stats),
+         "print the server's statistics afterwards")
+        ;
+
+    po::positional_options_description p;
+    p.add("input-file", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv)
+              .options(desc)
+              .positional(p)
+              .run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        cout << "Usage: convolution-client [-fhiors] [<input file>]" << endl;
+        cout << desc << endl;
+        return 0;
+    }
+
+    if (inputFile.empty() && !stats)
+    {
+        cout << "No image or --stats specified. Pass \"-h\" for help"
+             << endl;
+        return -1;
+    }
+
+    int fd = connectServer(socketPath);
+    if (fd < 0)
+    {
+        cout << "Could not connect to " << socketPath << endl;
+        return -1;
+    }
+
+    string status;
+    vector<char> reply;
+    if (!inputFile.empty())
+    {
+        // Grey images go as one byte a pixel, colour ones as four
+        Bitmap image;
+        image.storage = BYTE_PIXELS;
+        try
+        {
+            image.read(inputFile);
+        }
+        catch (std::runtime_error &e)
+        {
+            cout << e.what() << endl;
+            return -1;
+        }
+        int channels = image.grey? 1 : 4;
+        int width = image.infoHeader->biWidth;
+        int height = image.infoHeader->biHeight;
+        size_t bytes = (size_t)width * height * channels;
+
+        string request = "FILTER " + std::to_string(width) + " "
+            + std::to_string(height) + " " + std::to_string(channels) + " "
+            + boost::join(filters, ";") + "\n";
+
+        for (int i = 0; i < repeat; i++)
+        {
+            boost::timer::cpu_timer timer;
+            if (!writeBytes(fd, request.c_str(), request.size())
+                || !writeBytes(fd, image.data(), bytes)
+                || !readReply(fd, status, reply))
+            {
+                cout << "Lost the connection to " << socketPath << endl;
+                return -1;
+            }
+            printf("%s took %0.3f ms\n",
+                   status.substr(0, status.find(' ')).c_str(),
+                   timer.elapsed().wall / 1000000.0);
+
+            if (!boost::starts_with(status, "OK"))
+            {
+                cout << status << endl;
+            }
+            else if (i == repeat - 1)
+            {
+                std::copy(reply.begin(), reply.end(), (char*)image.data());
+                try
+                {
+                    image.write(outputFile);
+                }
+                catch (std::runtime_error &e)
+                {
+                    cout << e.what() << endl;
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (stats)
+    {
+        if (!writeBytes(fd, "STATS\n", 6) || !readReply(fd, status, reply))
+        {
+            cout << "Lost the connection to " << socketPath << endl;
+            return -1;
+        }
+        cout << string(reply.begin(), reply.end());
+    }
+
+    close(fd);
+    return 0;
+}
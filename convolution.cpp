@@ -1,123 +1,70 @@
 #define __CL_ENABLE_EXCEPTIONS
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <map>
+#include <stdexcept>
 #include <CL/cl.hpp>
 #include <boost/program_options.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/timer/timer.hpp>
 
 #include "convolution.hpp"
+#include "pipeline.hpp"
+#include "engine.hpp"
 #include "filters.hpp"
-#include "filter_factory.hpp"
 #include "bmp.hpp"
+#include "planner.hpp"
+#include "stream.hpp"
+#include "bench.hpp"
+#include "batch.hpp"
+#include "serve.hpp"
+#include "trace.hpp"
 
 using std::string;
-using std::ifstream;
+using std::ofstream;
 using std::endl;
 using std::cout;
 using std::vector;
 using std::ostringstream;
-using cl::Program;
-using cl::Platform;
-using cl::Event;
-using cl::Context;
-using cl::Kernel;
+using std::map;
 using cl::Error;
-using cl::CommandQueue;
-using cl::NDRange;
-using cl::NullRange;
-using cl::Buffer;
-using cl::Device;
 using boost::lexical_cast;
+using boost::timer::cpu_timer;
 
 namespace po = boost::program_options;
 
 struct Args
 {
-    string inputFile, outputFile;
+    string inputFile, outputFile, backend;
     vector<string> filters;
+    bool pipeline, fold, bench, autotune, listDevices, verbose;
+    string zeroCopy, kernelVariant;
+    int stripHeight, warmup, repetitions, subDevices, ioThreads, queueDepth;
+    string devices;
+    string benchFile, traceFile, tuningFile;
+    string batch, outputDir, serve;
+    PixelStorage storage;
+    PixelLayout layout;
+    BorderMode border;
+    ConvolutionMethod method;
 };
+// Option names of each BorderMode, in order
+static const char *BORDER_NAMES[] = {"zero", "clamp", "mirror", "wrap"};
+static const int BORDER_COUNT = 4;
 
-struct Environment
-{
-    Context             context;
-    vector<Device> devices;
-    Device            device;
-    CommandQueue        queue;
-    Program             program;
-    Kernel kernel;
-};
-
-struct Buffers
-{
-    Buffer inputImage, outputImage, filter;
-};
-
-struct Images
-{
-    int imageWidth, imageHeight, imageSize;
-    int bufferedWidth, bufferedHeight, bufferedSize;
-    Bitmap inputImage, outputImage, bufferedImage;
-    size_t dataSize, bufferedDataSize;
-};
-
-static const int LOCAL_WORK_GROUP_SIZE = 16;
-
-size_t readSource(string filename, string &source)
-{
-    ifstream file (filename.c_str(), std::ios::binary);
-
-    file.seekg (0, std::ios::end);
-    std::streampos size = file.tellg();
-    if (size == -1)
-    {
-        cout << "File " << filename << " could not be read";
-        exit(-1);
-    }
-    file.seekg (0, std::ios::beg);
-
-    source.resize(size);
-    file.read (&source[0],size);
-    file.close();
-
-    return size;
-}
-
-
-void copyOutputToInput(Images &imgs, const Buffers &buffs, Environment &env)
-{
-    // Copy back to input image for the next filter, if any
-    if(imgs.inputImage.grey)
-    {
-    // Read the image back to the host
-        env.queue.enqueueReadBuffer(buffs.outputImage, CL_TRUE, 0,
-                                    imgs.dataSize,
-                                    imgs.outputImage.greyData, 0);
-
-
-        std::copy(imgs.outputImage.greyData,
-                  imgs.outputImage.greyData + imgs.imageSize,
-                  imgs.inputImage.greyData);
-    }
-    else
-    {
-        env.queue.enqueueReadBuffer(buffs.outputImage, CL_TRUE, 0,
-                                    imgs.dataSize,
-                                    imgs.outputImage.colourData, 0);
-
-
-        std::copy(imgs.outputImage.colourData,
-                  imgs.outputImage.colourData + imgs.imageSize,
-                  imgs.inputImage.colourData);
-    }
-}
+// Option names of each ConvolutionMethod, in order
+static const char *METHOD_NAMES[] = {"auto", "direct", "fft"};
+static const int METHOD_COUNT = 3;
 
 void parseArgs (const int argc, const char * const * argv, Args &args)
 {
-    string usage = "convolution [-fhio] [<input file>] [-fhio]";
+    string usage = "convolution [-bfhioprs] [<input file>] [-bfhioprs]";
+
+    string storage, layout, border, method;
 
     ostringstream filterHelp;
     filterHelp
@@ -136,14 +83,18 @@ void parseArgs (const int argc, const char * const * argv, Args &args)
         << "  a = filter size\n"
         << "  b = direction\n\n"
         << "emboss:a\n"
-        << "  a = filter size\n\n\n"
+        << "  a = filter size\n\n"
+        << "custom:a,b,...\n"
+        << "  n*n filter coefficients, row by row\n\n\n"
         << "directions are:\n"
         << "  0 = full\n"
         << "  1 = horizontal\n"
         << "  2 = vertical\n"
         << "  3 = top right -> bottom left\n"
         << "  4 = top left -> bottom right\n\n"
-        << "filter sizes must be odd and in the interval [1,15]";
+        << "filter sizes must be odd. Blurs take any size, other filters "
+        << "sizes up to 15 on the OpenCL backend and any size on the CPU "
+        << "backend";
     po::options_description desc("Allowed options");
     desc.add_options()
         ("help,h", "produce help message")
@@ -156,6 +107,134 @@ void parseArgs (const int argc, const char * const * argv, Args &args)
         ("filter,f",
          po::value< vector<string> >(&args.filters),
          filterHelp.str().c_str())
+        ("backend,b",
+         po::value<string>(&args.backend)->default_value("opencl"),
+         "where to run the filters\n"
+         "  opencl = OpenCL GPU device\n"
+         "  cpu    = native multi-threaded SIMD code")
+        ("devices",
+         po::value<string>(&args.devices)->default_value("gpu"),
+         "OpenCL devices to split each image between, in bands of rows "
+         "sized by how fast each device filters\n"
+         "  gpu   = the first GPU of the first platform\n"
+         "  all   = every device of every platform\n"
+         "  i,j,... = the devices with these numbers in --list-devices")
+        ("sub-devices",
+         po::value<int>(&args.subDevices)->default_value(0),
+         "split each selected device that can be partitioned, such as a "
+         "CPU, into this many sub-devices with equal shares of its compute "
+         "units, each taking its own band. 0 keeps devices whole")
+        ("zero-copy",
+         po::value<string>(&args.zeroCopy)->default_value("auto"),
+         "whether OpenCL buffers use the host's image memory in place, "
+         "mapping it to read results, instead of copying images to and "
+         "from the device\n"
+         "  auto = on devices that share host memory\n"
+         "  on   = always\n"
+         "  off  = never")
+        ("kernel-variant",
+         po::value<string>(&args.kernelVariant)->default_value("auto"),
+         "which OpenCL kernel filters that are neither separable nor boxes "
+         "run with\n"
+         "  auto  = the tuned one, or tiled\n"
+         "  tiled = one pixel per work item, or several a work group apart\n"
+         "  strip = a strip of neighbouring pixels per work item, reusing "
+         "taps from registers")
+        ("list-devices",
+         po::bool_switch(&args.listDevices),
+         "list the OpenCL devices with their numbers and exit")
+        ("pipeline,p",
+         po::bool_switch(&args.pipeline),
+         "keep the image on the OpenCL device for the whole filter chain "
+         "and only read back the final result")
+        ("fold",
+         po::bool_switch(&args.fold),
+         "fold adjacent filters into a single pass even where that "
+         "changes the result, near the image edges or where the clamp "
+         "between them would trigger. Without it only 1x1 filters such as "
+         "brighten are folded into a filter before them whose output always "
+         "stays in [0,255]")
+        ("strip-height,s",
+         po::value<int>(&args.stripHeight)->default_value(0),
+         "stream the image through the CPU backend in strips of this many "
+         "rows instead of loading it whole, whatever --backend is left "
+         "at. 0 loads the whole image")
+        ("storage",
+         po::value<string>(&storage)->default_value("float"),
+         "how pixels are held in host and device memory\n"
+         "  float = 32-bit float per channel\n"
+         "  u8    = 8-bit per channel, widened to float only inside the "
+         "filter")
+        ("layout",
+         po::value<string>(&layout)->default_value("interleaved"),
+         "how colour channels are arranged\n"
+         "  interleaved = one four channel pixel at a time\n"
+         "  planar      = separate R, G and B planes, each filtered like "
+         "a greyscale image")
+        ("border",
+         po::value<string>(&border)->default_value("zero"),
+         "what filters see outside the image\n"
+         "  zero   = black\n"
+         "  clamp  = the nearest edge pixel\n"
+         "  mirror = the image reflected about its edge\n"
+         "  wrap   = the opposite edge of the image")
+        ("convolution",
+         po::value<string>(&method)->default_value("auto"),
+         "how the CPU backend applies filters\n"
+         "  auto   = by running sums for blurs large enough to gain, by "
+         "FFT for other filters larger than 15 once they pass the size "
+         "where it was measured to be faster, directly otherwise\n"
+         "  direct = one multiply-add per tap\n"
+         "  fft    = overlap-add FFT convolution")
+        ("autotune",
+         po::bool_switch(&args.autotune),
+         "time every legal work group shape for each filter on this "
+         "device and image type and keep the fastest in the tuning file")
+        ("tuning-file",
+         po::value<string>(&args.tuningFile)->default_value("tuning.cache"),
+         "where tuned work group shapes are stored and loaded from")
+        ("batch",
+         po::value<string>(&args.batch),
+         "filter every .bmp file of this directory, or every file this "
+         "list file names one per line, in one process instead of the "
+         "input file")
+        ("output-dir",
+         po::value<string>(&args.outputDir)->default_value("filtered"),
+         "where --batch writes each result, under the name of its input")
+        ("io-threads",
+         po::value<int>(&args.ioThreads)->default_value(2),
+         "threads decoding images ahead of the filters in --batch, and "
+         "threads encoding the results")
+        ("serve",
+         po::value<string>(&args.serve),
+         "keep the devices and kernels warm and filter the images clients "
+         "send to a Unix socket at this path, until stopped")
+        ("queue-depth",
+         po::value<int>(&args.queueDepth)->default_value(8),
+         "requests --serve holds while one is filtered before it answers "
+         "BUSY")
+        ("bench",
+         po::bool_switch(&args.bench),
+         "time every stage of blurs of each size from 1 to 15 on the "
+         "selected backend instead of running the given filters")
+        ("warmup",
+         po::value<int>(&args.warmup)->default_value(2),
+         "untimed runs of each benchmark before the timed ones")
+        ("repetitions,r",
+         po::value<int>(&args.repetitions)->default_value(10),
+         "timed runs of each benchmark")
+        ("bench-file",
+         po::value<string>(&args.benchFile)->default_value("bench.json"),
+         "where to write the benchmark results as JSON")
+        ("trace",
+         po::value<string>(&args.traceFile),
+         "record a timeline of host work and OpenCL commands in this file, "
+         "in Chrome trace format. Not available with --serve")
+        ("verbose,v",
+         po::bool_switch(&args.verbose),
+         "report each file read and written, filters folded, bands split "
+         "and work groups tuned on stderr in --batch, --serve and --bench, "
+         "which are otherwise quiet about them")
         ;
 
     po::positional_options_description p;
@@ -175,219 +254,324 @@ void parseArgs (const int argc, const char * const * argv, Args &args)
         exit(0);
     }
 
-    if (!vm.count("filter"))
+    if (!vm.count("filter") && !args.bench && !args.listDevices
+        && args.serve.empty())
     {
         cout << "No filters specified. Pass \"-h\" for help" << endl;
         exit(-1);
     }
-}
 
-float strToFloat (string s)
-{
-    return lexical_cast<float>(s);
-}
+    if (args.autotune && args.backend != "opencl")
+    {
+        cout << "Only the OpenCL backend can be autotuned" << endl;
+        exit(-1);
+    }
 
-Filter *createFilter(string filterDesc)
-{
-    static FilterFactory ff;
+    if (args.warmup < 0 || args.repetitions < 1)
+    {
+        cout << "Benchmarks need at least one repetition and no negative "
+             << "warmup" << endl;
+        exit(-1);
+    }
 
-    vector<string> strs;
-    boost::split(strs, filterDesc, boost::is_any_of(":"));
+    if (args.bench && args.stripHeight > 0)
+    {
+        cout << "Streaming cannot be benchmarked" << endl;
+        exit(-1);
+    }
 
-    vector<string> args;
-    boost::split(args, strs[1], boost::is_any_of(","));
+    if (args.zeroCopy != "auto" && args.zeroCopy != "on"
+        && args.zeroCopy != "off")
+    {
+        cout << "Unknown zero-copy setting " << args.zeroCopy
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
+    }
 
-    vector<float> floatArgs;
-    std::transform(args.begin(), args.end(),
-                   back_inserter(floatArgs),
-                   &strToFloat);
+    if (args.kernelVariant != "auto" && args.kernelVariant != "tiled"
+        && args.kernelVariant != "strip")
+    {
+        cout << "Unknown kernel variant " << args.kernelVariant
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
+    }
 
-    return ff.createFilter(strs[0], floatArgs);
-}
+    if (args.subDevices < 0)
+    {
+        cout << "Sub-devices must not be negative" << endl;
+        exit(-1);
+    }
 
-template <class T>
-T *bufferInputImage (Images &imgs, const Filter *filter, T *toBuffer)
-{
-    int bufferWidth = filter->size()/2;
+    if (!args.batch.empty() && (args.bench || args.stripHeight > 0))
+    {
+        cout << "Batches cannot be benchmarked or streamed" << endl;
+        exit(-1);
+    }
 
-    imgs.bufferedWidth = bufferWidth * 2 + imgs.imageWidth;
-    imgs.bufferedHeight = bufferWidth * 2 + imgs.imageHeight;
-    imgs.bufferedSize = imgs.bufferedWidth * imgs.bufferedHeight;
+    if (args.ioThreads < 1)
+    {
+        cout << "Batches need at least one I/O thread" << endl;
+        exit(-1);
+    }
 
-    T *bufferedImage = new T[imgs.bufferedSize]();
+    if (!args.serve.empty()
+        && (args.bench || args.stripHeight > 0 || !args.batch.empty()))
+    {
+        cout << "The server cannot also benchmark, stream or batch" << endl;
+        exit(-1);
+    }
 
-    int inputIndex, bufferedIndex;
-    for (int i = 0; i < imgs.imageHeight; i++)
+    // The server runs until it is killed, so its trace would only grow
+    // and never be written
+    if (!args.serve.empty() && !args.traceFile.empty())
     {
-        for (int j = 0; j < imgs.imageWidth; j++)
-        {
-            inputIndex = i * imgs.imageWidth + j;
-            bufferedIndex = (i + bufferWidth)
-                * (imgs.imageWidth+bufferWidth*2)
-                + j + bufferWidth;
-            bufferedImage[bufferedIndex] = toBuffer[inputIndex];
-        }
+        cout << "The server cannot be traced" << endl;
+        exit(-1);
     }
 
-    imgs.bufferedDataSize = imgs.bufferedSize * sizeof(T);
+    if (args.queueDepth < 1)
+    {
+        cout << "The server needs a queue depth of at least one" << endl;
+        exit(-1);
+    }
 
-    return bufferedImage;
-}
+    if (args.stripHeight < 0)
+    {
+        cout << "Strip height must not be negative" << endl;
+        exit(-1);
+    }
 
-void initImages (Images &imgs, const string &inputFile)
-{
-    imgs.inputImage.read(inputFile);
-    imgs.imageHeight = imgs.inputImage.infoHeader->biHeight;
-    imgs.imageWidth = imgs.inputImage.infoHeader->biWidth;
-
-    imgs.bufferedImage.grey = imgs.inputImage.grey;
-    //not going to change any info, so can just copy pointers
-    imgs.outputImage.infoHeader = imgs.inputImage.infoHeader;
-    imgs.outputImage.fileHeader = imgs.inputImage.fileHeader;
-    imgs.outputImage.extraHeader = imgs.inputImage.extraHeader;
-    imgs.outputImage.grey = imgs.inputImage.grey;
-
-    // Size of the input and output images on the host
-    imgs.imageSize = imgs.imageHeight * imgs.imageWidth;
-    imgs.dataSize = imgs.imageSize *
-        (imgs.inputImage.grey?sizeof(float):sizeof(cl_float4));
-
-    if (imgs.inputImage.grey)
+    if (storage != "float" && storage != "u8")
     {
-        imgs.outputImage.greyData = new float[imgs.imageSize];
+        cout << "Unknown storage " << storage
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
     }
-    else
+    args.storage = storage == "u8"? BYTE_PIXELS : FLOAT_PIXELS;
+
+    if (layout != "interleaved" && layout != "planar")
     {
-        imgs.outputImage.colourData = new cl_float4[imgs.imageSize];
+        cout << "Unknown layout " << layout
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
     }
-}
+    args.layout = layout == "planar"? PLANAR_PIXELS : INTERLEAVED_PIXELS;
 
-void bufferCorrectInputImage(Images &imgs, const Filter *filter)
-{
-    if (imgs.inputImage.grey)
+    const char **found = std::find(BORDER_NAMES, BORDER_NAMES + BORDER_COUNT,
+                                   border);
+    if (found == BORDER_NAMES + BORDER_COUNT)
     {
-        imgs.bufferedImage.greyData =
-            bufferInputImage(imgs, filter, imgs.inputImage.greyData);
+        cout << "Unknown border " << border
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
     }
-    else
+    args.border = (BorderMode)(found - BORDER_NAMES);
+
+    found = std::find(METHOD_NAMES, METHOD_NAMES + METHOD_COUNT, method);
+    if (found == METHOD_NAMES + METHOD_COUNT)
     {
-        imgs.bufferedImage.colourData =
-            bufferInputImage(imgs, filter,
-                             imgs.inputImage.colourData);
+        cout << "Unknown convolution " << method
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
     }
-}
+    args.method = (ConvolutionMethod)(found - METHOD_NAMES);
 
-void setKernelArgs(Environment &env, const Buffers &buffs,
-                   size_t bufferSize, size_t pixelSize)
-{
-    env.kernel.setArg(0, buffs.inputImage);
-    env.kernel.setArg(1, buffs.outputImage);
-    env.kernel.setArg(2, buffs.filter);
+    if (args.border == WRAP_BORDER && args.stripHeight > 0)
+    {
+        cout << "Wrapping borders cannot be streamed" << endl;
+        exit(-1);
+    }
 
-    size_t localDimension = (LOCAL_WORK_GROUP_SIZE + bufferSize*2);
-    size_t localSize = localDimension * localDimension;
+    if (args.layout == PLANAR_PIXELS && args.stripHeight > 0)
+    {
+        cout << "The planar layout cannot be streamed" << endl;
+        exit(-1);
+    }
 
-    clSetKernelArg(env.kernel(), 3, localSize*pixelSize, NULL);
+    // Streaming only has the CPU backend, which OpenCL's default gives
+    // way to unless asked for by name
+    if (args.stripHeight > 0 && args.backend == "opencl"
+        && !vm["backend"].defaulted())
+    {
+        cout << "Only the CPU backend can be streamed" << endl;
+        exit(-1);
+    }
+
+    if (args.backend != "opencl" && args.backend != "cpu")
+    {
+        cout << "Unknown backend " << args.backend
+             << ". Pass \"-h\" for help" << endl;
+        exit(-1);
+    }
 }
 
-void runKernel(const CommandQueue &queue, const Kernel &kernel,
-               int workSizeX, int workSizeY)
+// The options the library takes, from the command line
+PipelineOptions pipelineOptions(const Args &args)
 {
-    const NDRange global_work_size (workSizeX,
-                                    workSizeY);
-    const NDRange local_work_size (LOCAL_WORK_GROUP_SIZE,
-                                   LOCAL_WORK_GROUP_SIZE);
-
-    Event event;
-
-    queue.enqueueNDRangeKernel(kernel, NullRange,
-                                   global_work_size, local_work_size,
-                                   NULL, &event);
-    event.wait();
-
-    cl_ulong time_start, time_end;
-    double total_time;
-
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
-    total_time = time_end - time_start;
-    printf("Filter took %0.3f ms to apply\n", (total_time / 1000000.0) );
+    PipelineOptions options;
+    options.backend = args.backend;
+    options.devices = args.devices;
+    options.subDevices = args.subDevices;
+    options.zeroCopy = args.zeroCopy;
+    options.kernelVariant = args.kernelVariant;
+    options.tuningFile = args.tuningFile;
+    options.pipeline = args.pipeline;
+    options.fold = args.fold;
+    options.layout = args.layout;
+    options.border = args.border;
+    options.method = args.method;
+    return options;
 }
 
-void createBuffers(const Images &imgs, Filter *filter,
-                   const Context &context, Buffers &buffs)
+// One run of a filter from decoding the input file to encoding the
+// output, with every stage timed on its own. Programs are dropped from
+// the cache first so that each run pays for its compile.
+void benchFilter(const Args &args, Filter *filter, Environment &env,
+                 BenchResult &result)
 {
-    void *buffMem;
-    void *outMem;
-    if (imgs.inputImage.grey)
+    cpu_timer timer;
+    Images imgs;
+    initImages(imgs, args.inputFile, args.storage, args.layout,
+               args.border, args.method);
+    result.add("decode", elapsedMs(timer));
+
+    if (args.backend == "cpu")
     {
-        buffMem = imgs.bufferedImage.greyData;
-        outMem = imgs.outputImage.greyData;
+        // The generic loop is timed alongside to show what unrolling the
+        // taps for each size gains, and FFT to show how far off its
+        // crossover is. An untimed run first keeps the page faults of the
+        // first allocation out of all the timings.
+        applyCpuFilter(imgs, filter, UNROLLED_TAPS);
+        double generic = applyCpuFilter(imgs, filter, GENERIC_TAPS);
+        result.add("kernel", applyCpuFilter(imgs, filter, UNROLLED_TAPS));
+        result.add("kernel-generic", generic);
+        imgs.method = FFT_CONVOLUTION;
+        result.add("kernel-fft", applyCpuFilter(imgs, filter, UNROLLED_TAPS));
     }
     else
     {
-        buffMem = imgs.bufferedImage.colourData;
-        outMem = imgs.outputImage.colourData;
-    }
-
-    buffs.inputImage = Buffer (context,
-                               CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
-                               imgs.bufferedDataSize, buffMem);
-
-    buffs.outputImage = Buffer (context,
-                                CL_MEM_WRITE_ONLY|CL_MEM_COPY_HOST_PTR,
-                                imgs.dataSize, outMem);
-
-    buffs.filter = Buffer (context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
-                           sizeof(float)*filter->size()*filter->size(),
-                           filter->filter());
-}
-
-void initEnvironment(Environment &env, const string &sourceFile)
-{
-    vector <Platform> platforms;
-    Platform::get(&platforms);
-
-    cl_context_properties cprops[3] =
-        { CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[0](), 0 };
-    env.context = Context (CL_DEVICE_TYPE_GPU, cprops);
+        Buffers buffs;
+        double upload = 0, kernel = 0, download = 0, tiled = 0, strip = 0;
+
+        timer.start();
+        createFilterBuffers(imgs, filter, env.context, buffs);
+        upload += elapsedMs(timer);
+
+        WorkGroup group = tunedWorkGroup(env, imgs, filter);
+        string options = buildOptions(imgs, filter, group);
+        env.programs.clear();
+        env.kernels.clear();
+        timer.start();
+        buildProgram(env, options);
+        double compile = elapsedMs(timer);
+
+        WorkGroup tiledGroup = tunedWorkGroup(env, imgs, filter, "tiled");
+        WorkGroup stripGroup = tunedWorkGroup(env, imgs, filter, "strip");
+        string tiledOptions = buildOptions(imgs, filter, tiledGroup);
+        string stripOptions = buildOptions(imgs, filter, stripGroup);
+        buildProgram(env, tiledOptions, sparseTapSource(filter));
+        buildProgram(env, stripOptions, sparseTapSource(filter));
+
+        for (int plane = 0; plane < imgs.planes; plane++)
+        {
+            timer.start();
+            createImageBuffers(imgs, env, buffs, plane);
+            env.queue.finish();
+            upload += elapsedMs(timer);
+
+            // Both variants of the 2D kernel over the whole matrix, even
+            // where the filter runs separably, to show what strips gain
+            tiled += runConvolution(imgs, filter, env, buffs, tiledOptions,
+                                    tiledGroup);
+            strip += runConvolution(imgs, filter, env, buffs, stripOptions,
+                                    stripGroup);
+
+            kernel += runFilter(imgs, filter, env, buffs, options, group);
+
+            timer.start();
+            readOutputImage(imgs, buffs, env, plane);
+            download += elapsedMs(timer);
+        }
 
-    env.devices = env.context.getInfo<CL_CONTEXT_DEVICES>();
-    env.device = env.devices[0];
-    env.queue = CommandQueue (env.context, env.device,
-                              CL_QUEUE_PROFILING_ENABLE);
+        result.add("upload", upload);
+        result.add("compile", compile);
+        result.add("kernel", kernel);
+        result.add("kernel-tiled", tiled);
+        result.add("kernel-strip", strip);
+        result.add("download", download);
+    }
 
-    string source;
-    size_t sourceLength = readSource(
-        sourceFile,
-        source);
+    timer.start();
+    imgs.outputImage.write(args.outputFile);
+    result.add("encode", elapsedMs(timer));
 
-    Program::Sources sources(1, std::make_pair(source.c_str(), sourceLength));
-    env.program = Program (env.context, sources);
+    // Useful channels only, the fourth lane of colour pixels is padding
+    int channels = imgs.inputImage.grey? 1 : 3;
+    result.bytes = 2.0 * imgs.dataSize * imgs.planes;
+    result.flops = 2.0 * filter->size() * filter->size()
+        * imgs.imageSize * channels;
 }
 
-void buildProgram(const Images &imgs, const Filter *filter, Environment &env)
+// Sweeps blurs of every size through warmup and timed runs in this one
+// process, then reports each stage and writes the JSON results
+void runBenchmark(const Args &args)
 {
-    int bufferSize = filter->size()/2;
-    ostringstream options;
-    options << "-D BUFFER_SIZE=" << bufferSize << " "
-            << "-D DOUBLE_BUFFER_SIZE=" << bufferSize*2 << " "
-            << "-D HEIGHT=" << imgs.bufferedHeight << " "
-            << "-D WIDTH=" << imgs.bufferedWidth << " "
-            << "-D FACTOR=" << filter->factor() << " "
-            << "-D BIAS=" << filter->bias();
+    vector<Environment> envs(1);
+    if (args.backend == "opencl")
+    {
+        BitmapReader reader(args.inputFile);
+        bool singleChannel = reader.header.grey
+            || args.layout == PLANAR_PIXELS;
+        initEnvironments(envs, pipelineOptions(args), singleChannel?
+                         "convolutiongrey.cl":"convolutioncolour.cl");
+        if (envs.size() > 1)
+        {
+            cout << "Only one device can be benchmarked" << endl;
+            exit(-1);
+        }
+    }
+    Environment &env = envs[0];
 
-    try
+    vector<BenchResult> results;
+    for (int size = 1; size <= 15; size += 2)
     {
-        env.program.build(env.devices,options.str().c_str());
+        Filter *filter = createFilter("blur:" + lexical_cast<string>(size)
+                                      + ",0");
+        BenchResult result;
+        result.filterSize = size;
+
+        for (int i = 0; i < args.warmup; i++)
+        {
+            BenchResult ignored;
+            benchFilter(args, filter, env, ignored);
+        }
+        for (int i = 0; i < args.repetitions; i++)
+        {
+            benchFilter(args, filter, env, result);
+        }
+        results.push_back(result);
+        delete filter;
     }
-    catch (Error e)
+
+    printBenchResults(cout, results);
+
+    map<string, string> settings;
+    settings["input"] = args.inputFile;
+    settings["backend"] = args.backend;
+    settings["storage"] = args.storage == BYTE_PIXELS? "u8" : "float";
+    settings["layout"] = args.layout == PLANAR_PIXELS?
+        "planar" : "interleaved";
+    settings["border"] = BORDER_NAMES[args.border];
+    settings["convolution"] = METHOD_NAMES[args.method];
+    if (args.backend == "opencl")
     {
-        string info;
-        env.program.getBuildInfo(env.device, CL_PROGRAM_BUILD_LOG, &info);
-        cout << info;
-        exit(-1);
+        settings["zero-copy"] = env.zeroCopy? "on" : "off";
     }
+    settings["warmup"] = lexical_cast<string>(args.warmup);
+    settings["repetitions"] = lexical_cast<string>(args.repetitions);
+
+    ofstream json(args.benchFile.c_str());
+    writeBenchJson(json, settings, results);
 }
 
 int main(int argc, char** argv) {
@@ -396,57 +580,133 @@ int main(int argc, char** argv) {
         Args args;
         parseArgs(argc, argv, args);
 
-        Images imgs;
-        initImages(imgs, args.inputFile);
-
-        vector<string>::iterator filterIt;
-        for (filterIt = args.filters.begin();
-             filterIt != args.filters.end(); filterIt++)
+        if (args.listDevices)
         {
-            Filter *filter = createFilter(*filterIt);
-            cout << "Applying " << filter->filterName() << endl;
-
-            bufferCorrectInputImage(imgs, filter);
-
-            Environment env;
-            string sourceFile = imgs.inputImage.grey?
-                "convolutiongrey.cl":"convolutioncolour.cl";
-            initEnvironment(env, sourceFile);
+            listDevices();
+            return 0;
+        }
 
+        if (!args.traceFile.empty())
+        {
+            startTrace(args.traceFile);
+        }
 
-            Buffers buffs;
-            createBuffers(imgs, filter, env.context, buffs);
+        // Single images report as they go. The modes that run many would
+        // say the same for each, from several threads at once.
+        if (args.verbose)
+        {
+            setLog(&std::cerr);
+        }
+        else if (!args.bench && args.batch.empty() && args.serve.empty())
+        {
+            setLog(&cout);
+        }
 
-            buildProgram(imgs, filter, env);
-            env.kernel = Kernel (env.program, "convolution");
+        if (args.bench)
+        {
+            runBenchmark(args);
+            finishTrace();
+            return 0;
+        }
 
-            size_t pixelSize = imgs.inputImage.grey?
-                sizeof(float):sizeof(cl_float4);
-            setKernelArgs(env, buffs, filter->size()/2, pixelSize);
+        if (args.stripHeight > 0)
+        {
+            vector<Filter*> filters;
+            for (size_t i = 0; i < args.filters.size(); i++)
+            {
+                filters.push_back(createFilter(args.filters[i]));
+            }
+            vector<Filter*> plan = planFilters(filters, args.fold);
+            streamFilters(args.inputFile, args.outputFile, plan,
+                          args.stripHeight, args.storage, args.border,
+                          args.method);
+
+            // Folds the planner made, then the filters themselves
+            for (size_t i = 0; i < plan.size(); i++)
+            {
+                if (std::find(filters.begin(), filters.end(), plan[i])
+                    == filters.end())
+                {
+                    delete plan[i];
+                }
+            }
+            for (size_t i = 0; i < filters.size(); i++)
+            {
+                delete filters[i];
+            }
+            finishTrace();
+            return 0;
+        }
 
-            runKernel(env.queue, env.kernel,
-                      imgs.bufferedHeight, imgs.bufferedWidth);
+        if (!args.serve.empty())
+        {
+            // Each request names its own filters
+            runServer(pipelineOptions(args), args.serve, args.queueDepth);
+            return 0;
+        }
 
-            copyOutputToInput(imgs, buffs, env);
+        Pipeline pipeline(pipelineOptions(args));
+        pipeline.setFilters(args.filters);
 
-            imgs.outputImage.write(args.outputFile);
+        if (!args.batch.empty())
+        {
+            vector<string> files = batchFiles(args.batch);
+            // Tuned on the first image that reads, for the rest to use.
+            // The batch reports the ones that do not.
+            for (size_t i = 0; args.autotune && i < files.size(); i++)
+            {
+                Bitmap first;
+                first.storage = args.storage;
+                first.layout = args.layout;
+                try
+                {
+                    first.read(files[i]);
+                }
+                catch (std::runtime_error &)
+                {
+                    continue;
+                }
+                pipeline.autotune(first);
+                break;
+            }
+            size_t failed = runBatch(pipeline, files, args.outputDir,
+                                     args.storage, args.layout,
+                                     args.ioThreads);
+            finishTrace();
+            return failed? -1 : 0;
         }
 
-        if (imgs.inputImage.grey)
+        Bitmap image;
+        image.storage = args.storage;
+        image.layout = args.layout;
+        image.read(args.inputFile);
+
+        if (args.autotune)
         {
-            delete[] imgs.inputImage.greyData;
-            delete[] imgs.bufferedImage.greyData;
+            pipeline.autotune(image);
         }
-        else
+
+        pipeline.run(image);
+        for (size_t i = 0; i < pipeline.filters().size(); i++)
         {
-            delete[] imgs.inputImage.colourData;
-            delete[] imgs.bufferedImage.colourData;
+            cout << "Applying " << pipeline.filters()[i]->filterName()
+                 << endl;
+            printf("Filter took %0.3f ms to apply\n",
+                   pipeline.filterTimes()[i]);
         }
+        image.write(args.outputFile);
+
+        finishTrace();
     }
     catch(Error error)
     {
         std::cout << error.what() << "(" << error.err() << ")" << std::endl;
         exit(-1);
     }
+    catch (std::exception &error)
+    {
+        cout << error.what() << endl;
+        exit(-1);
+    }
     return 0;
 }
@@ -1,87 +1,371 @@
 #pragma OPENCL EXTENSION cl_amd_printf : enable
 
-__kernel void convolution (__global float *inputImage,
-                           __global float *outputImage,
+//pixels are stored as bytes or floats, but always computed in floats
+#ifdef BYTE_PIXELS
+typedef uchar pixel;
+#define LOAD(p) convert_float(p)
+#define STORE(v) convert_uchar_sat(v)
+#else
+typedef float pixel;
+#define LOAD(p) (p)
+#define STORE(v) (v)
+#endif
+
+//what lies outside the image, chosen with -D BORDER
+#define ZERO_BORDER 0
+#define CLAMP_BORDER 1
+#define MIRROR_BORDER 2
+#define WRAP_BORDER 3
+
+//box filters give the step between the taps of their line with -D
+#ifndef BOX_RUN
+#define BOX_RUN 1
+#define BOX_ROW_STEP 0
+#define BOX_COLUMN_STEP 1
+#endif
+
+//filters with zeros or repeated coefficients have their taps generated
+//ahead of this file as SPARSE_TAPS(TAP), a sum of TAP(fx,fy) over the
+//non-zero taps with the coefficients as literals. CACHE_TAP reads a tap
+//of the cached tile from its top left corner, tile, lw pixels a row.
+#define CACHE_TAP(fx, fy) tile[(fx)*lw + (fy)]
+
+//maps a row or column index into [0,n), or to -1 where it reads as zero
+int borderIndex(int i, int n)
+{
+    if (i >= 0 && i < n)
+    {
+        return i;
+    }
+#if BORDER == CLAMP_BORDER
+    return clamp(i, 0, n-1);
+#elif BORDER == MIRROR_BORDER
+    //reflect about the edge pixel without repeating it
+    if (n == 1)
+    {
+        return 0;
+    }
+    int period = 2*(n-1);
+    i = abs(i) % period;
+    return i < n ? i : period - i;
+#elif BORDER == WRAP_BORDER
+    return (i % n + n) % n;
+#else
+    return -1;
+#endif
+}
+
+//reads pixel (x,y) of the HEIGHT x WIDTH image, which may be outside it
+float fetch(__global pixel *image, int x, int y)
+{
+    int row = borderIndex(x, HEIGHT);
+    int col = borderIndex(y, WIDTH);
+    if (row < 0 || col < 0)
+    {
+        return 0;
+    }
+    return LOAD(image[row*WIDTH + col]);
+}
+
+//each work item filters PIXELS_PER_ITEM pixels of its row, a work group
+//width apart, so neighbouring work items still read neighbouring pixels
+__kernel void convolution (__global pixel *inputImage,
+                           __global pixel *outputImage,
                            __constant float *filter,
                            __local float *cache)
 {
-    int modx, mody, centre;
-
     int ix = get_global_id(0);
-    int iy = get_global_id(1);
-    int iid = ix*WIDTH + iy;
 
     int lx = get_local_id(0);
     int ly = get_local_id(1);
+    int groupWidth = get_local_size(1) * PIXELS_PER_ITEM;
     int lh = get_local_size(0) + DOUBLE_BUFFER_SIZE;
-    int lw = get_local_size(1) + DOUBLE_BUFFER_SIZE;
-    int lid = (lx+BUFFER_SIZE) * lw + ly + BUFFER_SIZE;
+    int lw = groupWidth + DOUBLE_BUFFER_SIZE;
 
-    //cache this thread's pixel
-    cache[lid] = inputImage[iid];
+    //image position of the top left of the cached tile and its halo
+    int tileX = get_group_id(0)*get_local_size(0) - BUFFER_SIZE;
+    int tileY = get_group_id(1)*groupWidth - BUFFER_SIZE;
 
-    //if in buffer space
-    if (ix < BUFFER_SIZE || iy < BUFFER_SIZE ||
-        ix > HEIGHT-BUFFER_SIZE || iy >= WIDTH-BUFFER_SIZE)
+    //the whole work group strides over the tile, so the halo and the
+    //image borders need no special cases
+    for (int x = lx; x < lh; x += get_local_size(0))
+    {
+        for (int y = ly; y < lw; y += get_local_size(1))
+        {
+            cache[x*lw + y] = fetch(inputImage, tileX + x, tileY + y);
+        }
+    }
+
+    //wait until all threads have pulled their data
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    //the global size is rounded up to whole work groups
+    if (ix >= HEIGHT)
     {
-        //the only purpose was to cache, so just synchronise and return
-        barrier(CLK_LOCAL_MEM_FENCE);
         return;
     }
 
-    int xOffset = 0;
-    int yOffset = 0;
-    //top line
-    if (lx < BUFFER_SIZE)
+    for (int p = 0; p < PIXELS_PER_ITEM; p++)
     {
-        xOffset = -BUFFER_SIZE;
-        cache[lx*lw + ly + BUFFER_SIZE] = inputImage[(ix-BUFFER_SIZE)*WIDTH + iy];
+        int cy = ly + p*get_local_size(1);
+        int iy = tileY + BUFFER_SIZE + cy;
+        if (iy >= WIDTH)
+        {
+            return;
+        }
+
+#ifdef SPARSE_TAPS
+        __local float *tile = cache + lx*lw + cy;
+        float sum = SPARSE_TAPS(CACHE_TAP);
+#else
+        float sum = 0;
+        int fIndex = 0;
+
+        for (int fx = 0; fx <= DOUBLE_BUFFER_SIZE; fx++)
+        {
+            __local float *row = cache + (lx+fx)*lw + cy;
+            for (int fy = 0; fy <= DOUBLE_BUFFER_SIZE; fy++, fIndex++)
+            {
+                sum += row[fy] * filter[fIndex];
+            }
+        }
+#endif
+
+        float val = sum * FACTOR + BIAS;
+
+        outputImage[ix*WIDTH + iy] =
+            STORE(clamp(val, (float)0, (float)255));
     }
-    //bottom line
-    else if (lx >= get_local_size(0) - BUFFER_SIZE)
+}
+
+#if PIXELS_PER_ITEM == 4 || PIXELS_PER_ITEM == 8
+#if PIXELS_PER_ITEM == 8
+typedef float8 strip;
+#define VLOAD_STRIP vload8
+#define VSTORE_STRIP vstore8
+#else
+typedef float4 strip;
+#define VLOAD_STRIP vload4
+#define VSTORE_STRIP vstore4
+#endif
+
+//each work item filters a strip of PIXELS_PER_ITEM neighbouring pixels of
+//its row as one vector. The taps under a strip are read from the cache
+//into registers once per filter row, and every tap of that row is then a
+//vector load from them.
+__kernel void convolutionStrip (__global pixel *inputImage,
+                                __global pixel *outputImage,
+                                __constant float *filter,
+                                __local float *cache)
+{
+    int ix = get_global_id(0);
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int groupWidth = get_local_size(1) * PIXELS_PER_ITEM;
+    int lh = get_local_size(0) + DOUBLE_BUFFER_SIZE;
+    int lw = groupWidth + DOUBLE_BUFFER_SIZE;
+
+    int tileX = get_group_id(0)*get_local_size(0) - BUFFER_SIZE;
+    int tileY = get_group_id(1)*groupWidth - BUFFER_SIZE;
+
+    for (int x = lx; x < lh; x += get_local_size(0))
     {
-        xOffset = BUFFER_SIZE;
-        cache[(lx+DOUBLE_BUFFER_SIZE)*lw +ly+BUFFER_SIZE] =
-            inputImage[(ix+BUFFER_SIZE)*WIDTH+iy];
+        for (int y = ly; y < lw; y += get_local_size(1))
+        {
+            cache[x*lw + y] = fetch(inputImage, tileX + x, tileY + y);
+        }
     }
 
-    //far left
-    if (ly < BUFFER_SIZE)
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (ix >= HEIGHT)
     {
-        yOffset = -BUFFER_SIZE;
-        cache[lid-BUFFER_SIZE] = inputImage[iid-BUFFER_SIZE];
+        return;
     }
-    //far right
-    else if (ly >= get_local_size(1) - BUFFER_SIZE)
+
+    int cy = ly*PIXELS_PER_ITEM;
+#ifdef SPARSE_TAPS
+    //each tap of the strip is one vector load from the cache
+    __local float *tile = cache + lx*lw + cy;
+#define STRIP_TAP(fx, fy) VLOAD_STRIP(0, tile + (fx)*lw + (fy))
+    strip sum = SPARSE_TAPS(STRIP_TAP);
+#else
+    strip sum = 0;
+    int fIndex = 0;
+
+    for (int fx = 0; fx <= DOUBLE_BUFFER_SIZE; fx++)
     {
-        yOffset = BUFFER_SIZE;
-        cache[lid+BUFFER_SIZE] = inputImage[iid+BUFFER_SIZE];
+        __local float *row = cache + (lx+fx)*lw + cy;
+        float taps[PIXELS_PER_ITEM + DOUBLE_BUFFER_SIZE];
+        for (int t = 0; t < PIXELS_PER_ITEM + DOUBLE_BUFFER_SIZE; t++)
+        {
+            taps[t] = row[t];
+        }
+        for (int fy = 0; fy <= DOUBLE_BUFFER_SIZE; fy++, fIndex++)
+        {
+            sum += VLOAD_STRIP(0, taps + fy) * filter[fIndex];
+        }
     }
+#endif
+
+    float val[PIXELS_PER_ITEM];
+    VSTORE_STRIP(clamp(sum * FACTOR + BIAS, (strip)0, (strip)255), 0, val);
 
-    //corner
-    if (xOffset != 0 && yOffset != 0)
+    int iy = tileY + BUFFER_SIZE + cy;
+    for (int p = 0; p < PIXELS_PER_ITEM && iy + p < WIDTH; p++)
     {
-        cache[(lx+BUFFER_SIZE+xOffset) * lw + ly+BUFFER_SIZE+yOffset] = inputImage[(ix+xOffset)*WIDTH + iy + yOffset];
+        outputImage[ix*WIDTH + iy + p] = STORE(val[p]);
     }
+}
+#endif
 
-    //wait until all threads have pulled their data
-    barrier(CLK_LOCAL_MEM_FENCE);
+//separable filters run as a horizontal pass over every row...
+__kernel void convolutionRows (__global pixel *inputImage,
+                               __global float *outputImage,
+                               __constant float *filter)
+{
+    int ix = get_global_id(0);
+    int iy = get_global_id(1);
 
     float sum = 0;
-    int rowPlusLid;
-    int fIndex = 0;
+    for (int f = 0; f <= DOUBLE_BUFFER_SIZE; f++)
+    {
+        sum += fetch(inputImage, ix, iy - BUFFER_SIZE + f) * filter[f];
+    }
+
+    outputImage[ix*WIDTH + iy] = sum;
+}
 
-    for (int fx = -BUFFER_SIZE; fx <= BUFFER_SIZE; fx++)
+//...followed by a vertical pass, which applies the factor, bias and clamp
+__kernel void convolutionColumns (__global float *inputImage,
+                                  __global pixel *outputImage,
+                                  __constant float *filter)
+{
+    int ix = get_global_id(0);
+    int iy = get_global_id(1);
+
+    float sum = 0;
+    for (int f = 0; f <= DOUBLE_BUFFER_SIZE; f++)
     {
-        rowPlusLid = fx * lw + lid;
-        for (int fy = -BUFFER_SIZE; fy <= BUFFER_SIZE; fy++, fIndex++)
+        int row = borderIndex(ix - BUFFER_SIZE + f, HEIGHT);
+        if (row >= 0)
         {
-            //printf("main %d,%d - %d\n", get_group_id(0), get_group_id(1), lid + row + fy);
-            sum += cache[rowPlusLid + fy] * filter[fIndex];
+            sum += inputImage[row*WIDTH + iy] * filter[f];
         }
     }
 
     float val = sum * FACTOR + BIAS;
 
-    outputImage[(ix-BUFFER_SIZE)*(WIDTH-DOUBLE_BUFFER_SIZE)+(iy-BUFFER_SIZE)] = val < 0 ? 0 : val > 255 ? 255 : val;
+    outputImage[ix*WIDTH + iy] = STORE(clamp(val, (float)0, (float)255));
+}
+
+//box filters have every tap one, so each pixel's sum is its neighbour's
+//along the line plus the tap entering the window and minus the one leaving
+//it. Each work item sums BOX_RUN pixels of a line and only the first sums
+//the whole window. Lines down the image start in a band of BOX_RUN rows,
+//and diagonals start beside the image where needed to cover all of it.
+__kernel void boxLines (__global pixel *inputImage,
+                        __global pixel *outputImage)
+{
+    int ix = get_global_id(0) * (BOX_ROW_STEP ? BOX_RUN : 1);
+    int iy = get_global_id(1) * (BOX_ROW_STEP ? 1 : BOX_RUN)
+        - (BOX_ROW_STEP && BOX_COLUMN_STEP > 0 ? BOX_RUN - 1 : 0);
+
+    float sum = 0;
+    bool started = false;
+    for (int i = 0; i < BOX_RUN;
+         i++, ix += BOX_ROW_STEP, iy += BOX_COLUMN_STEP)
+    {
+        if (ix >= HEIGHT || iy < 0 || iy >= WIDTH)
+        {
+            if (started)
+            {
+                return;
+            }
+            continue;
+        }
+
+        if (!started)
+        {
+            for (int f = -BUFFER_SIZE; f <= BUFFER_SIZE; f++)
+            {
+                sum += fetch(inputImage, ix + f*BOX_ROW_STEP,
+                             iy + f*BOX_COLUMN_STEP);
+            }
+            started = true;
+        }
+        else
+        {
+            sum += fetch(inputImage, ix + BUFFER_SIZE*BOX_ROW_STEP,
+                         iy + BUFFER_SIZE*BOX_COLUMN_STEP)
+                - fetch(inputImage, ix - (BUFFER_SIZE+1)*BOX_ROW_STEP,
+                        iy - (BUFFER_SIZE+1)*BOX_COLUMN_STEP);
+        }
+
+        float val = sum * FACTOR + BIAS;
+
+        outputImage[ix*WIDTH + iy] = STORE(clamp(val, (float)0, (float)255));
+    }
+}
+
+//square boxes sum BOX_RUN pixels of a row into the intermediate image...
+__kernel void boxRows (__global pixel *inputImage,
+                       __global float *outputImage)
+{
+    int ix = get_global_id(0);
+    int iy = get_global_id(1) * BOX_RUN;
+    int end = min(iy + BOX_RUN, WIDTH);
+
+    float sum = 0;
+    for (int f = -BUFFER_SIZE; f <= BUFFER_SIZE; f++)
+    {
+        sum += fetch(inputImage, ix, iy + f);
+    }
+
+    for (int y = iy; y < end; y++)
+    {
+        if (y > iy)
+        {
+            sum += fetch(inputImage, ix, y + BUFFER_SIZE)
+                - fetch(inputImage, ix, y - BUFFER_SIZE - 1);
+        }
+        outputImage[ix*WIDTH + y] = sum;
+    }
+}
+
+//reads row x of column y of the intermediate image, which may be outside
+float fetchSum(__global float *image, int x, int y)
+{
+    int row = borderIndex(x, HEIGHT);
+    return row < 0 ? (float)0 : image[row*WIDTH + y];
+}
+
+//...and then BOX_RUN pixels of a column of that, which applies the
+//factor, bias and clamp
+__kernel void boxColumns (__global float *inputImage,
+                          __global pixel *outputImage)
+{
+    int ix = get_global_id(0) * BOX_RUN;
+    int iy = get_global_id(1);
+    int end = min(ix + BOX_RUN, HEIGHT);
+
+    float sum = 0;
+    for (int f = -BUFFER_SIZE; f <= BUFFER_SIZE; f++)
+    {
+        sum += fetchSum(inputImage, ix + f, iy);
+    }
+
+    for (int x = ix; x < end; x++)
+    {
+        if (x > ix)
+        {
+            sum += fetchSum(inputImage, x + BUFFER_SIZE, iy)
+                - fetchSum(inputImage, x - BUFFER_SIZE - 1, iy);
+        }
+
+        float val = sum * FACTOR + BIAS;
+
+        outputImage[x*WIDTH + iy] = STORE(clamp(val, (float)0, (float)255));
+    }
 }
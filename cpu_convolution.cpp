@@ -0,0 +1,495 @@
+#include "cpu_convolution.hpp"
+#include "box.hpp"
+#include "fft.hpp"
+#include "parallel.hpp"
+#include "pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+static inline float clampPixel(float val)
+{
+    return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+// Loads widen stored pixels to float and stores narrow them again, so
+// byte images are only ever float inside registers
+#ifdef __AVX__
+static inline __m256 load8(const float *p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+static inline __m256 load8(const unsigned char *p)
+{
+#ifdef __AVX2__
+    __m128i bytes = _mm_loadl_epi64((const __m128i*)p);
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+#else
+    return _mm256_setr_ps(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+#endif
+}
+
+static inline void store8(float *p, __m256 val)
+{
+    _mm256_storeu_ps(p, val);
+}
+
+static inline void store8(unsigned char *p, __m256 val)
+{
+    float tmp[8];
+    _mm256_storeu_ps(tmp, val);
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = (unsigned char)tmp[i];
+    }
+}
+#endif
+
+#ifdef __SSE__
+static inline __m128 load4(const float *p)
+{
+    return _mm_loadu_ps(p);
+}
+
+static inline __m128 load4(const unsigned char *p)
+{
+#ifdef __SSE4_1__
+    int bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+#else
+    return _mm_setr_ps(p[0], p[1], p[2], p[3]);
+#endif
+}
+
+static inline void store4(float *p, __m128 val)
+{
+    _mm_storeu_ps(p, val);
+}
+
+static inline void store4(unsigned char *p, __m128 val)
+{
+    float tmp[4];
+    _mm_storeu_ps(tmp, val);
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (unsigned char)tmp[i];
+    }
+}
+#endif
+
+// Both images are treated as rows of floats. A colour pixel is four
+// consecutive floats, so horizontal taps are "channels" floats apart and
+// a vector register holds several whole pixels. The filter may be
+// rectangular, which lets the separable passes reuse this loop with a
+// 1 x n or n x 1 filter and no clamp on the intermediate result.
+// inRow is the top left tap of the first of rowLength output floats,
+// and every tap must lie inside the input. Non-zero FW and FH fix the
+// filter size at compile time so that the tap loops are unrolled.
+template <class In, class Out, int FW, int FH>
+static void convolveRow(const In *inRow, Out *outRow,
+                        int inputRowLength, int rowLength, int channels,
+                        const float *filter, int filterWidth,
+                        int filterHeight, float factor, float bias,
+                        bool clamp)
+{
+    if (FW)
+    {
+        filterWidth = FW;
+    }
+    if (FH)
+    {
+        filterHeight = FH;
+    }
+    int x = 0;
+
+#ifdef __AVX__
+    const __m256 factor8 = _mm256_set1_ps(factor);
+    const __m256 bias8 = _mm256_set1_ps(bias);
+    const __m256 min8 = _mm256_set1_ps(clamp? 0 : -HUGE_VALF);
+    const __m256 max8 = _mm256_set1_ps(clamp? 255 : HUGE_VALF);
+
+    for (; x + 8 <= rowLength; x += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int fy = 0; fy < filterHeight; fy++)
+        {
+            const In *row = inRow + fy * inputRowLength + x;
+            const float *taps = filter + fy * filterWidth;
+            for (int fx = 0; fx < filterWidth; fx++)
+            {
+                __m256 coeff = _mm256_set1_ps(taps[fx]);
+                __m256 pixels = load8(row + fx*channels);
+#ifdef __FMA__
+                sum = _mm256_fmadd_ps(pixels, coeff, sum);
+#else
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(pixels, coeff));
+#endif
+            }
+        }
+        __m256 val = _mm256_add_ps(_mm256_mul_ps(sum, factor8), bias8);
+        val = _mm256_min_ps(_mm256_max_ps(val, min8), max8);
+        store8(outRow + x, val);
+    }
+#endif
+#ifdef __SSE__
+    const __m128 factor4 = _mm_set1_ps(factor);
+    const __m128 bias4 = _mm_set1_ps(bias);
+    const __m128 min4 = _mm_set1_ps(clamp? 0 : -HUGE_VALF);
+    const __m128 max4 = _mm_set1_ps(clamp? 255 : HUGE_VALF);
+
+    for (; x + 4 <= rowLength; x += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int fy = 0; fy < filterHeight; fy++)
+        {
+            const In *row = inRow + fy * inputRowLength + x;
+            const float *taps = filter + fy * filterWidth;
+            for (int fx = 0; fx < filterWidth; fx++)
+            {
+                __m128 coeff = _mm_set1_ps(taps[fx]);
+                __m128 pixels = load4(row + fx*channels);
+                sum = _mm_add_ps(sum, _mm_mul_ps(pixels, coeff));
+            }
+        }
+        __m128 val = _mm_add_ps(_mm_mul_ps(sum, factor4), bias4);
+        val = _mm_min_ps(_mm_max_ps(val, min4), max4);
+        store4(outRow + x, val);
+    }
+#endif
+    for (; x < rowLength; x++)
+    {
+        float sum = 0;
+        for (int fy = 0; fy < filterHeight; fy++)
+        {
+            const In *row = inRow + fy * inputRowLength + x;
+            const float *taps = filter + fy * filterWidth;
+            for (int fx = 0; fx < filterWidth; fx++)
+            {
+                sum += row[fx*channels] * taps[fx];
+            }
+        }
+        float val = sum * factor + bias;
+        outRow[x] = (Out)(clamp? clampPixel(val) : val);
+    }
+}
+
+// Filters up to this radius get a convolveRow of their own
+static const int MAX_UNROLLED_RADIUS = 7;
+
+// convolveRow for each radius of square, 1 x n and n x 1 filters, with
+// entry 0 of each table for filters of any size
+template <class In, class Out>
+struct RowKernels
+{
+    typedef void (*Function)(const In*, Out*, int, int, int, const float*,
+                             int, int, float, float, bool);
+
+    static constexpr Function square[MAX_UNROLLED_RADIUS + 2] =
+    {
+        &convolveRow<In, Out, 0, 0>,
+        &convolveRow<In, Out, 1, 1>, &convolveRow<In, Out, 3, 3>,
+        &convolveRow<In, Out, 5, 5>, &convolveRow<In, Out, 7, 7>,
+        &convolveRow<In, Out, 9, 9>, &convolveRow<In, Out, 11, 11>,
+        &convolveRow<In, Out, 13, 13>, &convolveRow<In, Out, 15, 15>
+    };
+    static constexpr Function horizontal[MAX_UNROLLED_RADIUS + 2] =
+    {
+        &convolveRow<In, Out, 0, 1>,
+        &convolveRow<In, Out, 1, 1>, &convolveRow<In, Out, 3, 1>,
+        &convolveRow<In, Out, 5, 1>, &convolveRow<In, Out, 7, 1>,
+        &convolveRow<In, Out, 9, 1>, &convolveRow<In, Out, 11, 1>,
+        &convolveRow<In, Out, 13, 1>, &convolveRow<In, Out, 15, 1>
+    };
+    static constexpr Function vertical[MAX_UNROLLED_RADIUS + 2] =
+    {
+        &convolveRow<In, Out, 1, 0>,
+        &convolveRow<In, Out, 1, 1>, &convolveRow<In, Out, 1, 3>,
+        &convolveRow<In, Out, 1, 5>, &convolveRow<In, Out, 1, 7>,
+        &convolveRow<In, Out, 1, 9>, &convolveRow<In, Out, 1, 11>,
+        &convolveRow<In, Out, 1, 13>, &convolveRow<In, Out, 1, 15>
+    };
+
+    // Chosen once per pass, so the pixel loops never branch on the size
+    static Function pick(int filterWidth, int filterHeight, TapLoop taps)
+    {
+        int radius = std::max(filterWidth, filterHeight) / 2;
+        int entry = taps == UNROLLED_TAPS && radius <= MAX_UNROLLED_RADIUS?
+            radius + 1 : 0;
+        if (filterHeight == 1)
+            return horizontal[entry];
+        if (filterWidth == 1)
+            return vertical[entry];
+        return filterWidth == filterHeight? square[entry] : square[0];
+    }
+};
+
+template <class In, class Out>
+constexpr typename RowKernels<In, Out>::Function
+RowKernels<In, Out>::square[];
+template <class In, class Out>
+constexpr typename RowKernels<In, Out>::Function
+RowKernels<In, Out>::horizontal[];
+template <class In, class Out>
+constexpr typename RowKernels<In, Out>::Function
+RowKernels<In, Out>::vertical[];
+
+// Where a convolution reads from and writes to. The input has haloRows
+// more rows than the output above and below it, and the rows beyond those
+// come from the border mode, as do the columns left and right of it.
+template <class In, class Out>
+struct Pass
+{
+    const In *input;
+    Out *output;
+    int width, height, haloRows, channels;
+    const float *filter;
+    int filterWidth, filterHeight;
+    float factor, bias;
+    bool clamp;
+    BorderMode border;
+    typename RowKernels<In, Out>::Function row;
+};
+
+// One output pixel with taps outside the input, fetched one at a time
+template <class In, class Out>
+static void convolveBorderPixel(const Pass<In, Out> &p, int y, int x)
+{
+    int inputHeight = p.height + p.haloRows*2;
+    int top = y + p.haloRows - p.filterHeight/2;
+    int left = x - p.filterWidth/2;
+
+    for (int c = 0; c < p.channels; c++)
+    {
+        float sum = 0;
+        for (int fy = 0; fy < p.filterHeight; fy++)
+        {
+            int row = borderIndex(top + fy, inputHeight, p.border);
+            if (row < 0)
+            {
+                continue;
+            }
+            for (int fx = 0; fx < p.filterWidth; fx++)
+            {
+                int col = borderIndex(left + fx, p.width, p.border);
+                if (col < 0)
+                {
+                    continue;
+                }
+                sum += p.input[((size_t)row * p.width + col) * p.channels + c]
+                    * p.filter[fy * p.filterWidth + fx];
+            }
+        }
+        float val = sum * p.factor + p.bias;
+        p.output[((size_t)y * p.width + x) * p.channels + c] =
+            (Out)(p.clamp? clampPixel(val) : val);
+    }
+}
+
+// Output rows [rowBegin, rowEnd). Pixels whose taps all lie inside the
+// input take the vector loop, the few near the borders do not.
+template <class In, class Out>
+static void convolveRows(const Pass<In, Out> &p, int rowBegin, int rowEnd)
+{
+    int radiusX = p.filterWidth/2;
+    int radiusY = p.filterHeight/2;
+    int inputHeight = p.height + p.haloRows*2;
+    int left = std::min(radiusX, p.width);
+    int right = std::max(p.width - radiusX, left);
+
+    for (int y = rowBegin; y < rowEnd; y++)
+    {
+        int top = y + p.haloRows - radiusY;
+        if (top < 0 || top + p.filterHeight > inputHeight)
+        {
+            for (int x = 0; x < p.width; x++)
+            {
+                convolveBorderPixel(p, y, x);
+            }
+            continue;
+        }
+
+        for (int x = 0; x < left; x++)
+        {
+            convolveBorderPixel(p, y, x);
+        }
+        p.row(p.input + ((size_t)top * p.width + left - radiusX)
+              * p.channels,
+              p.output + ((size_t)y * p.width + left) * p.channels,
+              p.width * p.channels, (right - left) * p.channels,
+              p.channels, p.filter, p.filterWidth, p.filterHeight,
+              p.factor, p.bias, p.clamp);
+        for (int x = right; x < p.width; x++)
+        {
+            convolveBorderPixel(p, y, x);
+        }
+    }
+}
+
+template <class In, class Out>
+static void convolvePass(const Pass<In, Out> &p)
+{
+    parallelRows(p.height, [&p](int rowBegin, int rowEnd)
+    {
+        convolveRows(p, rowBegin, rowEnd);
+    });
+}
+
+// The middle row or column of a filter whose taps all lie along it
+static bool lineTaps(const Filter *filter, std::vector<float> &line,
+                     bool &horizontal)
+{
+    int size = filter->size();
+    int middle = size/2;
+    const float *taps = filter->filter();
+    bool onRow = true, onColumn = true;
+    for (int i = 0; i < size; i++)
+    {
+        for (int j = 0; j < size; j++)
+        {
+            if (taps[i*size + j] != 0)
+            {
+                onRow = onRow && i == middle;
+                onColumn = onColumn && j == middle;
+            }
+        }
+    }
+    // Both only for a lone centre tap, which is no line
+    if (size < 3 || onRow == onColumn)
+    {
+        return false;
+    }
+
+    horizontal = onRow;
+    line.resize(size);
+    for (int i = 0; i < size; i++)
+    {
+        line[i] = onRow? taps[middle*size + i] : taps[i*size + middle];
+    }
+    return true;
+}
+
+template <class T>
+static void convolve(const T *input, T *output, int width, int height,
+                     int haloRows, int channels, const Filter *filter,
+                     BorderMode border, TapLoop taps)
+{
+    int size = filter->size();
+
+    // Lines along the middle row or column take one pass of their taps
+    std::vector<float> line;
+    bool horizontal;
+    if (lineTaps(filter, line, horizontal))
+    {
+        int lineWidth = horizontal? size : 1;
+        int lineHeight = horizontal? 1 : size;
+        Pass<T, T> pass = {input, output, width, height, haloRows, channels,
+                           &line[0], lineWidth, lineHeight,
+                           filter->factor(), filter->bias(), true, border,
+                           RowKernels<T, T>::pick(lineWidth, lineHeight,
+                                                  taps)};
+        convolvePass(pass);
+        return;
+    }
+
+    if (filter->separable())
+    {
+        // Horizontal pass over every input row, then a vertical pass over
+        // the intermediate image
+        int inputHeight = height + haloRows*2;
+        PooledBuffer buffer((size_t)inputHeight * width * channels
+                            * sizeof(float));
+        float *intermediate = buffer.as<float>();
+
+        Pass<T, float> rows = {input, intermediate, width, inputHeight,
+                               0, channels, &filter->rowFilter()[0], size, 1,
+                               1, 0, false, border,
+                               RowKernels<T, float>::pick(size, 1, taps)};
+        convolvePass(rows);
+
+        Pass<float, T> columns = {intermediate, output, width, height,
+                                  haloRows, channels,
+                                  &filter->columnFilter()[0], 1, size,
+                                  filter->factor(), filter->bias(), true,
+                                  border,
+                                  RowKernels<float, T>::pick(1, size, taps)};
+        convolvePass(columns);
+        return;
+    }
+
+    Pass<T, T> pass = {input, output, width, height, haloRows, channels,
+                       filter->filter(), size, size,
+                       filter->factor(), filter->bias(), true, border,
+                       RowKernels<T, T>::pick(size, size, taps)};
+    convolvePass(pass);
+}
+
+// Running sums when the method is automatic and the filter is a box
+// large enough for them to pay, then FFT when it is asked for or pays,
+// then the tap loops
+template <class T, class Pixel>
+static void apply(const Pixel *input, Pixel *output, int width, int height,
+                  int haloRows, int channels, const Filter *filter,
+                  BorderMode border, TapLoop taps, ConvolutionMethod method)
+{
+    BoxShape box;
+    if (method == AUTO_CONVOLUTION && findBoxShape(filter, box) &&
+        boxIsFaster(filter, box))
+    {
+        boxConvolve(input, output, width, height, haloRows, filter, box,
+                    border);
+    }
+    else if (method == FFT_CONVOLUTION ||
+             (method == AUTO_CONVOLUTION && fftIsFaster(filter)))
+    {
+        fftConvolve(input, output, width, height, haloRows, filter, border);
+    }
+    else
+    {
+        convolve((const T*)input, (T*)output, width, height, haloRows,
+                 channels, filter, border, taps);
+    }
+}
+
+void cpuConvolve(const float *input, float *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border, TapLoop taps,
+                 ConvolutionMethod method)
+{
+    apply<float>(input, output, width, height, haloRows, 1, filter, border,
+                 taps, method);
+}
+
+void cpuConvolve(const cl_float4 *input, cl_float4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border, TapLoop taps,
+                 ConvolutionMethod method)
+{
+    apply<float>(input, output, width, height, haloRows, 4, filter, border,
+                 taps, method);
+}
+
+void cpuConvolve(const unsigned char *input, unsigned char *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border, TapLoop taps,
+                 ConvolutionMethod method)
+{
+    apply<unsigned char>(input, output, width, height, haloRows, 1, filter,
+                         border, taps, method);
+}
+
+void cpuConvolve(const cl_uchar4 *input, cl_uchar4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border, TapLoop taps,
+                 ConvolutionMethod method)
+{
+    apply<unsigned char>(input, output, width, height, haloRows, 4, filter,
+                         border, taps, method);
+}
@@ -0,0 +1,59 @@
+#ifndef CPU_CONVOLUTION_HPP_GUARD
+#define CPU_CONVOLUTION_HPP_GUARD
+
+#include <CL/cl.hpp>
+#include "filters.hpp"
+#include "border.hpp"
+
+// How the tap loops are compiled. Unrolled taps use a loop specialised
+// for the filter size, up to 15 x 15, and the generic loop takes the size
+// at run time and exists to measure against.
+enum TapLoop
+{
+    UNROLLED_TAPS,
+    GENERIC_TAPS
+};
+
+// Whether filters are applied by the tap loops or by FFT. Automatic
+// applies box filters by running sums, and chooses FFT for other large
+// filters past the crossover measured by fftIsFaster.
+enum ConvolutionMethod
+{
+    AUTO_CONVOLUTION,
+    DIRECT_CONVOLUTION,
+    FFT_CONVOLUTION
+};
+
+// Native equivalents of the kernels in convolutiongrey.cl and
+// convolutioncolour.cl. The output is width x height. The input has
+// haloRows extra rows above and below it, so a strip of a larger image
+// can be filtered with its neighbouring rows; with no halo rows the top
+// and bottom edges come from the border mode, like the left and right.
+// Rows are split across all available cores. Byte images are widened to
+// float only while each pixel is computed. Filters of any odd size are
+// taken.
+void cpuConvolve(const float *input, float *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border,
+                 TapLoop taps = UNROLLED_TAPS,
+                 ConvolutionMethod method = AUTO_CONVOLUTION);
+
+void cpuConvolve(const cl_float4 *input, cl_float4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border,
+                 TapLoop taps = UNROLLED_TAPS,
+                 ConvolutionMethod method = AUTO_CONVOLUTION);
+
+void cpuConvolve(const unsigned char *input, unsigned char *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border,
+                 TapLoop taps = UNROLLED_TAPS,
+                 ConvolutionMethod method = AUTO_CONVOLUTION);
+
+void cpuConvolve(const cl_uchar4 *input, cl_uchar4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border,
+                 TapLoop taps = UNROLLED_TAPS,
+                 ConvolutionMethod method = AUTO_CONVOLUTION);
+
+#endif
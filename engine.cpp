@@ -0,0 +1,1436 @@
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <map>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <CL/cl.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "engine.hpp"
+#include "trace.hpp"
+#include "box.hpp"
+#include "log.hpp"
+
+using std::string;
+using std::ifstream;
+using std::endl;
+using std::cout;
+using std::vector;
+using std::ostringstream;
+using std::map;
+using cl::Program;
+using cl::Platform;
+using cl::Event;
+using cl::Context;
+using cl::Kernel;
+using cl::Error;
+using cl::CommandQueue;
+using cl::NDRange;
+using cl::NullRange;
+using cl::Buffer;
+using cl::Device;
+using boost::lexical_cast;
+using boost::timer::cpu_timer;
+
+// Work group size in both dimensions when there is no tuned one
+static const int LOCAL_WORK_GROUP_SIZE = 16;
+// Neighbouring pixels each work item of the strip kernel filters when
+// there is no tuned shape
+static const int STRIP_PIXELS = 4;
+// Timed runs of each work group shape when autotuning
+static const int TUNING_RUNS = 3;
+// Pixels each work item of the box kernels sums along its line
+static const int BOX_RUN = 32;
+
+
+size_t readSource(string filename, string &source)
+{
+    ifstream file (filename.c_str(), std::ios::binary);
+
+    file.seekg (0, std::ios::end);
+    std::streampos size = file.tellg();
+    if (size == -1)
+    {
+        throw std::runtime_error("File " + filename + " could not be read");
+    }
+    file.seekg (0, std::ios::beg);
+
+    source.resize(size);
+    file.read (&source[0],size);
+    file.close();
+
+    return size;
+}
+
+
+// Start of one plane of an image whose planes are planeBytes long
+char *planeData(const Bitmap &bmp, int plane, size_t planeBytes)
+{
+    return (char*)bmp.data() + plane*planeBytes;
+}
+
+void readOutputImage(Images &imgs, const Buffers &buffs, Environment &env,
+                     int plane)
+{
+    Event event;
+    if (env.zeroCopy)
+    {
+        // The buffer is the output image, so mapping it only makes the
+        // kernel's writes visible to the host
+        void *mapped = env.queue.enqueueMapBuffer(buffs.outputImage, CL_TRUE,
+                                                  CL_MAP_READ, 0,
+                                                  imgs.dataSize, NULL,
+                                                  &event);
+        traceEvent("map output image", event);
+        env.queue.enqueueUnmapMemObject(buffs.outputImage, mapped);
+        return;
+    }
+
+    // Read the image back to the host
+    env.queue.enqueueReadBuffer(buffs.outputImage, CL_TRUE, 0,
+                                imgs.dataSize,
+                                planeData(imgs.outputImage, plane,
+                                          imgs.dataSize), 0, &event);
+    traceEvent("read output image", event);
+}
+
+// Makes the last filter's output the next filter's input. The images
+// trade buffers rather than copy, and the next filter overwrites the old
+// input.
+void swapImages(Images &imgs)
+{
+    std::swap(imgs.inputImage, imgs.outputImage);
+}
+
+void initImages(Images &imgs, const string &inputFile,
+                PixelStorage storage, PixelLayout layout, BorderMode border,
+                ConvolutionMethod method)
+{
+    imgs.inputImage.storage = storage;
+    imgs.inputImage.layout = layout;
+    imgs.inputImage.read(inputFile);
+    initImages(imgs, border, method);
+}
+
+void initImages(Images &imgs, BorderMode border, ConvolutionMethod method)
+{
+    imgs.imageHeight = imgs.inputImage.infoHeader->biHeight;
+    imgs.imageWidth = imgs.inputImage.infoHeader->biWidth;
+
+    // Not going to change any info, so the headers are shared
+    imgs.outputImage.infoHeader = imgs.inputImage.infoHeader;
+    imgs.outputImage.fileHeader = imgs.inputImage.fileHeader;
+    imgs.outputImage.extraHeader = imgs.inputImage.extraHeader;
+    imgs.outputImage.grey = imgs.inputImage.grey;
+    imgs.outputImage.storage = imgs.inputImage.storage;
+    imgs.outputImage.layout = imgs.inputImage.layout;
+
+    // Size of the input and output images on the host
+    imgs.imageSize = imgs.imageHeight * imgs.imageWidth;
+    imgs.dataSize = imgs.imageSize * imgs.inputImage.pixelSize();
+    imgs.planes = imgs.inputImage.planes();
+    imgs.border = border;
+    imgs.method = method;
+
+    imgs.outputImage.allocate(imgs.imageSize);
+}
+
+// Size of one pixel inside the kernels, whatever the storage
+size_t computePixelSize(const Images &imgs)
+{
+    return imgs.inputImage.singleChannel()? sizeof(float) : sizeof(cl_float4);
+}
+
+// Pixels in the local cache of one work group: its tile and the halo
+size_t localCacheSize(const WorkGroup &group, size_t bufferSize)
+{
+    return (group.rows + bufferSize*2)
+        * (group.columns*group.pixelsPerItem + bufferSize*2);
+}
+
+void setKernelArgs(Kernel &kernel, const Buffers &buffs,
+                   size_t bufferSize, size_t pixelSize,
+                   const WorkGroup &group)
+{
+    kernel.setArg(0, buffs.inputImage);
+    kernel.setArg(1, buffs.outputImage);
+    kernel.setArg(2, buffs.filter);
+
+    size_t localSize = localCacheSize(group, bufferSize);
+
+    clSetKernelArg(kernel(), 3, localSize*pixelSize, NULL);
+}
+
+void runKernel(const CommandQueue &queue, const Kernel &kernel,
+               const NDRange &global_work_size,
+               const NDRange &local_work_size, EventChain &chain)
+{
+    Event event;
+
+    queue.enqueueNDRangeKernel(kernel, NullRange,
+                                   global_work_size, local_work_size,
+                                   chain.waitList(), &event);
+    chain.add(event);
+    chain.kernels.push_back(std::make_pair(
+        kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), event));
+}
+
+// Traces completed kernels and returns the time they took, in ms
+double kernelTime(const KernelEvents &kernels)
+{
+    double total_time = 0;
+    for (size_t i = 0; i < kernels.size(); i++)
+    {
+        const Event &event = kernels[i].second;
+        if (tracing())
+        {
+            traceEvent(kernels[i].first, event);
+        }
+
+        cl_ulong time_start, time_end;
+        event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
+        event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+        total_time += time_end - time_start;
+    }
+    return total_time / 1000000.0;
+}
+
+// Waits for the chain and returns the time its kernels took, in ms
+double finishChain(EventChain &chain)
+{
+    if (!chain.last.empty())
+    {
+        chain.last[0].wait();
+    }
+    double time = kernelTime(chain.kernels);
+    chain.kernels.clear();
+    return time;
+}
+
+// Wall time since the timer was started, in ms
+double elapsedMs(const cpu_timer &timer)
+{
+    return timer.elapsed().wall / 1000000.0;
+}
+
+double applyCpuFilter(Images &imgs, const Filter *filter, TapLoop taps)
+{
+    TraceSpan span("cpu convolution");
+    cpu_timer timer;
+
+    const Bitmap &in = imgs.inputImage;
+    Bitmap &out = imgs.outputImage;
+    int width = imgs.imageWidth;
+    int height = imgs.imageHeight;
+    BorderMode border = imgs.border;
+    ConvolutionMethod method = imgs.method;
+
+    for (int plane = 0; plane < imgs.planes; plane++)
+    {
+        size_t offset = (size_t)plane * imgs.imageSize;
+
+        if (in.storage == BYTE_PIXELS)
+        {
+            if (in.singleChannel())
+                cpuConvolve(in.greyBytes + offset, out.greyBytes + offset,
+                            width, height, 0, filter, border, taps, method);
+            else
+                cpuConvolve(in.colourBytes, out.colourBytes, width, height,
+                            0, filter, border, taps, method);
+        }
+        else
+        {
+            if (in.singleChannel())
+                cpuConvolve(in.greyData + offset, out.greyData + offset,
+                            width, height, 0, filter, border, taps, method);
+            else
+                cpuConvolve(in.colourData, out.colourData, width, height,
+                            0, filter, border, taps, method);
+        }
+    }
+
+    return elapsedMs(timer);
+}
+
+void createFilterBuffers(const Images &imgs, Filter *filter,
+                         const Context &context, Buffers &buffs)
+{
+    TraceSpan span("create filter buffers");
+    buffs.filter = Buffer (context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                           sizeof(float)*filter->size()*filter->size(),
+                           filter->filter());
+
+    if (filter->separable())
+    {
+        // The pipeline allocates one intermediate image for the whole chain
+        if (buffs.intermediateImage() == NULL)
+        {
+            size_t pixelSize = computePixelSize(imgs);
+            buffs.intermediateImage = Buffer (context, CL_MEM_READ_WRITE,
+                                              imgs.imageHeight
+                                              * imgs.imageWidth * pixelSize);
+        }
+
+        buffs.rowFilter = Buffer (context,
+                                  CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                  sizeof(float)*filter->size(),
+                                  (void*)&filter->rowFilter()[0]);
+
+        buffs.columnFilter = Buffer (context,
+                                     CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                     sizeof(float)*filter->size(),
+                                     (void*)&filter->columnFilter()[0]);
+    }
+}
+
+void createImageBuffers(const Images &imgs, const Environment &env,
+                        Buffers &buffs, int plane)
+{
+    TraceSpan span("create image buffers");
+    cl_mem_flags host = env.zeroCopy? CL_MEM_USE_HOST_PTR
+                                    : CL_MEM_COPY_HOST_PTR;
+    buffs.inputImage = Buffer (env.context, CL_MEM_READ_ONLY|host,
+                               imgs.dataSize,
+                               planeData(imgs.inputImage, plane,
+                                         imgs.dataSize));
+
+    // The kernels write every pixel, so nothing goes to the device
+    buffs.outputImage = env.zeroCopy?
+        Buffer (env.context, CL_MEM_WRITE_ONLY|CL_MEM_USE_HOST_PTR,
+                imgs.dataSize, planeData(imgs.outputImage, plane,
+                                         imgs.dataSize)) :
+        Buffer (env.context, CL_MEM_WRITE_ONLY, imgs.dataSize);
+}
+
+// Every OpenCL device in the machine, platform by platform, in the order
+// --list-devices numbers them
+vector<Device> allDevices()
+{
+    vector<Platform> platforms;
+    Platform::get(&platforms);
+
+    vector<Device> devices;
+    for (size_t i = 0; i < platforms.size(); i++)
+    {
+        vector<Device> found;
+        try
+        {
+            platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &found);
+        }
+        catch (Error &)
+        {
+            // A platform without devices
+            continue;
+        }
+        devices.insert(devices.end(), found.begin(), found.end());
+    }
+    return devices;
+}
+
+void listDevices()
+{
+    vector<Device> devices = allDevices();
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        cl_device_type type = devices[i].getInfo<CL_DEVICE_TYPE>();
+        cout << i << ": " << devices[i].getInfo<CL_DEVICE_NAME>() << " ("
+             << (type & CL_DEVICE_TYPE_GPU? "GPU" :
+                 type & CL_DEVICE_TYPE_CPU? "CPU" : "other") << ", "
+             << devices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+             << " compute units)" << endl;
+    }
+}
+
+// Sub-devices of a device with 1/parts of its compute units each, or the
+// device itself where it cannot be partitioned
+vector<Device> partitionDevice(const Device &device, int parts)
+{
+    cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    cl_uint most = device.getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>();
+    vector<Device> subDevices(1, device);
+    if (parts < 2 || units < 2 || most < 2)
+    {
+        return subDevices;
+    }
+
+    cl_device_partition_property properties[] =
+    {
+        CL_DEVICE_PARTITION_EQUALLY,
+        (cl_device_partition_property)std::max<cl_uint>(1, units/parts),
+        0
+    };
+    try
+    {
+        Device(device).createSubDevices(properties, &subDevices);
+    }
+    catch (Error &)
+    {
+        subDevices.assign(1, device);
+    }
+    return subDevices;
+}
+
+// The devices named by --devices, each split by --sub-devices. The
+// default is the first GPU of the first platform.
+vector<Device> selectDevices(const string &selection, int subDevices)
+{
+    vector<Device> selected;
+    if (selection == "gpu")
+    {
+        vector<Platform> platforms;
+        Platform::get(&platforms);
+        platforms[0].getDevices(CL_DEVICE_TYPE_GPU, &selected);
+        selected.resize(1);
+    }
+    else if (selection == "all")
+    {
+        selected = allDevices();
+    }
+    else
+    {
+        vector<Device> devices = allDevices();
+        vector<string> indices;
+        boost::split(indices, selection, boost::is_any_of(","));
+        for (size_t i = 0; i < indices.size(); i++)
+        {
+            size_t index = devices.size();
+            try
+            {
+                index = lexical_cast<size_t>(indices[i]);
+            }
+            catch (boost::bad_lexical_cast &)
+            {
+            }
+            if (index >= devices.size())
+            {
+                throw std::runtime_error("Unknown device " + indices[i]
+                    + ". Pass \"--list-devices\" for the devices");
+            }
+            selected.push_back(devices[index]);
+        }
+    }
+
+    vector<Device> devices;
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        vector<Device> parts = partitionDevice(selected[i], subDevices);
+        devices.insert(devices.end(), parts.begin(), parts.end());
+    }
+    return devices;
+}
+
+// A context, queue and program cache of its own for one device
+void initEnvironment(Environment &env, const Device &device,
+                     const string &source)
+{
+    env.context = Context (device);
+    env.devices = vector<Device>(1, device);
+    env.device = device;
+    env.queue = CommandQueue (env.context, env.device,
+                              CL_QUEUE_PROFILING_ENABLE);
+    calibrateTrace(env.queue);
+    env.deviceName = env.device.getInfo<CL_DEVICE_NAME>();
+    env.source = source;
+    env.zeroCopy = env.device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+    env.kernelVariant = "auto";
+    env.rowsPerMs = 0;
+}
+
+void initEnvironments(vector<Environment> &envs,
+                      const PipelineOptions &options,
+                      const string &sourceFile)
+{
+    vector<Device> devices = selectDevices(options.devices,
+                                           options.subDevices);
+    string source;
+    readSource(sourceFile, source);
+
+    envs.resize(devices.size());
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        initEnvironment(envs[i], devices[i], source);
+        loadTuningCache(options.tuningFile, envs[i].tuning);
+        if (options.zeroCopy != "auto")
+        {
+            envs[i].zeroCopy = options.zeroCopy == "on";
+        }
+        envs[i].kernelVariant = options.kernelVariant;
+    }
+}
+
+// What the kernels compute in, which is what a tuned work group suits
+string kernelPixelType(const Images &imgs)
+{
+    string type = imgs.inputImage.singleChannel()? "grey" : "colour";
+    return type + (imgs.inputImage.storage == BYTE_PIXELS? "-u8" : "-float");
+}
+
+WorkGroup tunedWorkGroup(const Environment &env, const Images &imgs,
+                         const Filter *filter, const string &variant)
+{
+    TuningCache::const_iterator tuned =
+        env.tuning.find(tuningKey(env.deviceName, filter->size(),
+                                  kernelPixelType(imgs)));
+    if (tuned != env.tuning.end()
+        && (variant == "auto" || tuned->second.strip == (variant == "strip")))
+    {
+        return tuned->second;
+    }
+
+    WorkGroup group = {LOCAL_WORK_GROUP_SIZE, LOCAL_WORK_GROUP_SIZE, 1,
+                       false};
+    if (variant == "strip")
+    {
+        // The same tile as the tiled kernel's, in fewer work items
+        group.columns = LOCAL_WORK_GROUP_SIZE / STRIP_PIXELS;
+        group.pixelsPerItem = STRIP_PIXELS;
+        group.strip = true;
+    }
+    return group;
+}
+
+WorkGroup tunedWorkGroup(const Environment &env, const Images &imgs,
+                         const Filter *filter)
+{
+    return tunedWorkGroup(env, imgs, filter, env.kernelVariant);
+}
+
+string buildOptions(const Images &imgs, const Filter *filter,
+                    const WorkGroup &group)
+{
+    int bufferSize = filter->size()/2;
+    ostringstream options;
+    options << "-D BUFFER_SIZE=" << bufferSize << " "
+            << "-D DOUBLE_BUFFER_SIZE=" << bufferSize*2 << " "
+            << "-D HEIGHT=" << imgs.imageHeight << " "
+            << "-D WIDTH=" << imgs.imageWidth << " "
+            << "-D BORDER=" << imgs.border << " "
+            << "-D PIXELS_PER_ITEM=" << group.pixelsPerItem << " "
+            << "-D FACTOR=" << filter->factor() << " "
+            << "-D BIAS=" << filter->bias();
+    if (imgs.inputImage.storage == BYTE_PIXELS)
+    {
+        options << " -D BYTE_PIXELS";
+    }
+    BoxShape box;
+    if (findBoxShape(filter, box))
+    {
+        options << " -D BOX_RUN=" << BOX_RUN
+                << " -D BOX_ROW_STEP=" << box.rowStep
+                << " -D BOX_COLUMN_STEP=" << box.columnStep;
+    }
+    return options.str();
+}
+
+// Coefficient as an OpenCL float literal
+static string floatLiteral(float value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+    string literal = text;
+    if (literal.find_first_of(".en") == string::npos)
+    {
+        literal += ".0";
+    }
+    return literal + "f";
+}
+
+string sparseTapSource(const Filter *filter)
+{
+    int size = filter->size();
+    const float *taps = filter->filter();
+
+    // Non-zero taps grouped by coefficient, in the order first met
+    vector<float> coefficients;
+    vector<string> sums;
+    int nonZero = 0;
+    for (int i = 0; i < size*size; i++)
+    {
+        if (taps[i] == 0)
+        {
+            continue;
+        }
+        nonZero++;
+        size_t c = std::find(coefficients.begin(), coefficients.end(),
+                             taps[i]) - coefficients.begin();
+        if (c == coefficients.size())
+        {
+            coefficients.push_back(taps[i]);
+            sums.push_back("");
+        }
+        sums[c] += (sums[c].empty()? "TAP(" : "+TAP(")
+            + lexical_cast<string>(i / size) + ","
+            + lexical_cast<string>(i % size) + ")";
+    }
+
+    // Dense taps that all differ gain nothing over the loop
+    if (nonZero == size*size && coefficients.size() == (size_t)nonZero)
+    {
+        return "";
+    }
+
+    string expression;
+    for (size_t c = 0; c < coefficients.size(); c++)
+    {
+        string sum = "(" + sums[c] + ")";
+        if (coefficients[c] == 1)
+            expression += (c == 0? "" : "+") + sum;
+        else if (coefficients[c] == -1)
+            expression += "-" + sum;
+        else
+            expression += (c == 0? "" : "+") + sum + "*"
+                + floatLiteral(coefficients[c]);
+    }
+    if (expression.empty())
+    {
+        expression = "0.0f";
+    }
+
+    return "//generated from the filter's non-zero taps\n"
+        "#define SPARSE_TAPS(TAP) (" + expression + ")\n";
+}
+
+Program &buildProgram(Environment &env, const string &options)
+{
+    return buildProgram(env, options, "");
+}
+
+Program &buildProgram(Environment &env, const string &options,
+                      const string &taps)
+{
+    string key = taps + options;
+    map<string, Program>::iterator cached = env.programs.find(key);
+    if (cached != env.programs.end())
+    {
+        return cached->second;
+    }
+
+    TraceSpan span("build program");
+    // Generated taps are defined ahead of the kernels that use them
+    Program::Sources sources;
+    if (!taps.empty())
+    {
+        sources.push_back(std::make_pair(taps.c_str(), taps.size()));
+    }
+    sources.push_back(std::make_pair(env.source.c_str(), env.source.size()));
+    Program program (env.context, sources);
+
+    try
+    {
+        program.build(env.devices,options.c_str());
+    }
+    catch (Error &)
+    {
+        string info;
+        program.getBuildInfo(env.device, CL_PROGRAM_BUILD_LOG, &info);
+        throw std::runtime_error("Kernels failed to build:\n" + info);
+    }
+
+    return env.programs[key] = program;
+}
+
+Kernel &getKernel(Environment &env, const string &options,
+                  const string &taps, const string &name)
+{
+    string key = taps + options + " " + name;
+    map<string, Kernel>::iterator cached = env.kernels.find(key);
+    if (cached != env.kernels.end())
+    {
+        return cached->second;
+    }
+
+    return env.kernels[key] = Kernel (buildProgram(env, options, taps),
+                                      name.c_str());
+}
+
+Kernel &getKernel(Environment &env, const string &options,
+                  const string &name)
+{
+    return getKernel(env, options, "", name);
+}
+
+void runSeparableKernels(const Images &imgs, Environment &env,
+                         const Buffers &buffs, const string &options,
+                         EventChain &chain)
+{
+    Kernel &rows = getKernel(env, options, "convolutionRows");
+    rows.setArg(0, buffs.inputImage);
+    rows.setArg(1, buffs.intermediateImage);
+    rows.setArg(2, buffs.rowFilter);
+
+    Kernel &columns = getKernel(env, options, "convolutionColumns");
+    columns.setArg(0, buffs.intermediateImage);
+    columns.setArg(1, buffs.outputImage);
+    columns.setArg(2, buffs.columnFilter);
+
+    runKernel(env.queue, rows, NDRange(imgs.imageHeight, imgs.imageWidth),
+              NullRange, chain);
+    runKernel(env.queue, columns,
+              NDRange(imgs.imageHeight, imgs.imageWidth), NullRange, chain);
+}
+
+size_t roundUp(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+// Box filters run as running sums, BOX_RUN pixels of a line to each work
+// item. Square boxes sum rows into the intermediate image and then its
+// columns, and diagonal lines need work items starting beside the image.
+void runBoxKernels(const Images &imgs, Environment &env,
+                   const Buffers &buffs, const string &options,
+                   const BoxShape &box, EventChain &chain)
+{
+    size_t height = imgs.imageHeight;
+    size_t width = imgs.imageWidth;
+    size_t rowRuns = roundUp(width, BOX_RUN) / BOX_RUN;
+    size_t columnRuns = roundUp(height, BOX_RUN) / BOX_RUN;
+
+    if (box.square)
+    {
+        Kernel &rows = getKernel(env, options, "boxRows");
+        rows.setArg(0, buffs.inputImage);
+        rows.setArg(1, buffs.intermediateImage);
+
+        Kernel &columns = getKernel(env, options, "boxColumns");
+        columns.setArg(0, buffs.intermediateImage);
+        columns.setArg(1, buffs.outputImage);
+
+        runKernel(env.queue, rows, NDRange(height, rowRuns), NullRange,
+                  chain);
+        runKernel(env.queue, columns, NDRange(columnRuns, width), NullRange,
+                  chain);
+        return;
+    }
+
+    Kernel &lines = getKernel(env, options, "boxLines");
+    lines.setArg(0, buffs.inputImage);
+    lines.setArg(1, buffs.outputImage);
+
+    NDRange global = box.rowStep == 0? NDRange(height, rowRuns) :
+        NDRange(columnRuns, width + (box.columnStep != 0? BOX_RUN - 1 : 0));
+    runKernel(env.queue, lines, global, NullRange, chain);
+}
+
+// Enqueues the tiled or strip kernel over the filter's whole matrix
+void enqueueConvolution(const Images &imgs, Filter *filter, Environment &env,
+                        const Buffers &buffs, const string &options,
+                        const WorkGroup &group, EventChain &chain)
+{
+    Kernel &kernel = getKernel(env, options, sparseTapSource(filter),
+                               group.strip? "convolutionStrip"
+                               : "convolution");
+
+    setKernelArgs(kernel, buffs, filter->size()/2,
+                  computePixelSize(imgs), group);
+
+    // Whole work groups, the kernel skips the pixels past the edge
+    size_t columns = (imgs.imageWidth + group.pixelsPerItem - 1)
+        / group.pixelsPerItem;
+    runKernel(env.queue, kernel,
+              NDRange(roundUp(imgs.imageHeight, group.rows),
+                      roundUp(columns, group.columns)),
+              NDRange(group.rows, group.columns), chain);
+}
+
+// Enqueues the filter's kernels at the end of the chain
+void enqueueFilter(const Images &imgs, Filter *filter, Environment &env,
+                   const Buffers &buffs, const string &options,
+                   const WorkGroup &group, EventChain &chain)
+{
+    BoxShape box;
+    if (findBoxShape(filter, box))
+    {
+        runBoxKernels(imgs, env, buffs, options, box, chain);
+    }
+    else if (filter->separable())
+    {
+        runSeparableKernels(imgs, env, buffs, options, chain);
+    }
+    else
+    {
+        enqueueConvolution(imgs, filter, env, buffs, options, group, chain);
+    }
+}
+
+// The filter's kernels on their own, waited for and timed
+double runFilter(const Images &imgs, Filter *filter, Environment &env,
+                 const Buffers &buffs, const string &options,
+                 const WorkGroup &group)
+{
+    EventChain chain;
+    enqueueFilter(imgs, filter, env, buffs, options, group, chain);
+    return finishChain(chain);
+}
+
+double runConvolution(const Images &imgs, Filter *filter, Environment &env,
+                      const Buffers &buffs, const string &options,
+                      const WorkGroup &group)
+{
+    EventChain chain;
+    enqueueConvolution(imgs, filter, env, buffs, options, group, chain);
+    return finishChain(chain);
+}
+
+// Reads a plane's latest result back to the output image once the
+// commands before it have run, and after its previous readback
+void enqueueReadback(Images &imgs, Environment &env, DeviceRun &run,
+                     int plane)
+{
+    EventChain &chain = run.chains[plane];
+    vector<Event> waitFor = chain.last;
+    if (!run.reads[plane].empty())
+    {
+        waitFor.push_back(run.reads[plane].back());
+    }
+
+    Event event;
+    env.queue.enqueueReadBuffer(run.images[plane*2 + run.current], CL_FALSE,
+                                0, imgs.dataSize,
+                                planeData(imgs.outputImage, plane,
+                                          imgs.dataSize),
+                                &waitFor, &event);
+    run.reads[plane].push_back(event);
+    run.transfers.push_back(std::make_pair("read output image", event));
+    run.readbacks.expect(event);
+}
+
+// Enqueues the whole chain as one graph of events: uploads that do not
+// block, kernels that wait on the commands before them and readbacks that
+// callbacks count down. The host goes on to build and enqueue the next
+// filters while the device runs the first, and is free once this
+// returns. Unless pipelined, every filter's result is read back while
+// the device runs the next filter; pipelined, only the final one is.
+// Without copies the buffers are the images themselves and nothing is
+// read back.
+void enqueueOpenCLFilters(Images &imgs, const vector<Filter*> &filters,
+                          Environment &env, bool pipeline, DeviceRun &run)
+{
+    run.chains.assign(imgs.planes, EventChain());
+    run.reads.assign(imgs.planes, vector<Event>());
+    run.filterKernels.clear();
+    run.transfers.clear();
+    run.mapped.clear();
+    run.current = 0;
+
+    // Buffers over the host's images are made for each chain, as the
+    // images move, and copied ones are kept while the size stays the same
+    size_t intermediateBytes = imgs.imageSize*computePixelSize(imgs);
+    if (env.zeroCopy || run.images.size() != (size_t)imgs.planes*2
+        || run.imageBytes != imgs.dataSize
+        || run.intermediateBytes != intermediateBytes)
+    {
+        run.images.assign(imgs.planes*2, Buffer());
+        for (int plane = 0; plane < imgs.planes && !env.zeroCopy; plane++)
+        {
+            run.images[plane*2] = Buffer (env.context, CL_MEM_READ_WRITE,
+                                          imgs.dataSize);
+            run.images[plane*2 + 1] = Buffer (env.context, CL_MEM_READ_WRITE,
+                                              imgs.dataSize);
+        }
+        run.intermediateImage = Buffer (env.context, CL_MEM_READ_WRITE,
+                                        intermediateBytes);
+        run.imageBytes = imgs.dataSize;
+        run.intermediateBytes = intermediateBytes;
+    }
+
+    for (int plane = 0; plane < imgs.planes; plane++)
+    {
+        char *input = planeData(imgs.inputImage, plane, imgs.dataSize);
+        char *output = planeData(imgs.outputImage, plane, imgs.dataSize);
+        if (env.zeroCopy)
+        {
+            run.images[plane*2] = Buffer (env.context,
+                                          CL_MEM_READ_WRITE|CL_MEM_USE_HOST_PTR,
+                                          imgs.dataSize, input);
+            run.images[plane*2 + 1] = Buffer (env.context,
+                                              CL_MEM_READ_WRITE|
+                                              CL_MEM_USE_HOST_PTR,
+                                              imgs.dataSize, output);
+            continue;
+        }
+
+        Event upload;
+        env.queue.enqueueWriteBuffer(run.images[plane*2], CL_FALSE, 0,
+                                     imgs.dataSize, input, NULL, &upload);
+        run.chains[plane].add(upload);
+        run.transfers.push_back(std::make_pair("write input image", upload));
+    }
+
+    Buffers buffs;
+    buffs.intermediateImage = run.intermediateImage;
+
+    bool readEach = !pipeline && !env.zeroCopy;
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        Filter *filter = filters[i];
+        TraceSpan span("enqueue " + filter->filterName());
+
+        WorkGroup group = tunedWorkGroup(env, imgs, filter);
+        string options = buildOptions(imgs, filter, group);
+        createFilterBuffers(imgs, filter, env.context, buffs);
+
+        // Every plane uses the same kernels, so they are timed together
+        run.filterKernels.push_back(KernelEvents());
+        for (int plane = 0; plane < imgs.planes; plane++)
+        {
+            EventChain &chain = run.chains[plane];
+            const vector<Event> &reads = run.reads[plane];
+
+            // The output buffer may still be being read from two filters
+            // back
+            if (reads.size() >= 2)
+            {
+                chain.last.push_back(reads[reads.size() - 2]);
+            }
+            // Planes share the intermediate image, which the plane before
+            // may still be reading
+            if (plane > 0)
+            {
+                const vector<Event> &before = run.chains[plane - 1].last;
+                chain.last.insert(chain.last.end(), before.begin(),
+                                  before.end());
+            }
+
+            buffs.inputImage = run.images[plane*2 + run.current];
+            buffs.outputImage = run.images[plane*2 + 1-run.current];
+            enqueueFilter(imgs, filter, env, buffs, options, group, chain);
+
+            KernelEvents &kernels = run.filterKernels.back();
+            kernels.insert(kernels.end(), chain.kernels.begin(),
+                           chain.kernels.end());
+            chain.kernels.clear();
+        }
+        run.current = 1 - run.current;
+
+        for (int plane = 0; plane < imgs.planes; plane++)
+        {
+            if (readEach || (i + 1 == filters.size() && !env.zeroCopy))
+            {
+                enqueueReadback(imgs, env, run, plane);
+            }
+        }
+
+        // Start the device on this filter while the next one builds
+        env.queue.flush();
+    }
+
+    if (env.zeroCopy)
+    {
+        for (int plane = 0; plane < imgs.planes; plane++)
+        {
+            Event event;
+            run.mapped.push_back(env.queue.enqueueMapBuffer(
+                run.images[plane*2 + run.current], CL_FALSE, CL_MAP_READ, 0,
+                imgs.dataSize, &run.chains[plane].last, &event));
+            run.transfers.push_back(std::make_pair("map output image",
+                                                   event));
+            run.readbacks.expect(event);
+        }
+    }
+    env.queue.flush();
+}
+
+// Waits for the readbacks of an enqueued chain, leaving the result in the
+// output image, and returns each filter's time
+vector<double> finishOpenCLFilters(Images &imgs, Environment &env,
+                                   DeviceRun &run)
+{
+    run.readbacks.wait();
+
+    for (size_t i = 0; i < run.mapped.size(); i++)
+    {
+        env.queue.enqueueUnmapMemObject(run.images[i*2 + run.current],
+                                        run.mapped[i]);
+    }
+    env.queue.finish();
+
+    vector<double> times;
+    for (size_t i = 0; i < run.filterKernels.size(); i++)
+    {
+        times.push_back(kernelTime(run.filterKernels[i]));
+    }
+    // Only traced
+    kernelTime(run.transfers);
+
+    // After an even number of filters without copies, the result is in
+    // the input image
+    if (env.zeroCopy && run.current == 0)
+    {
+        swapImages(imgs);
+    }
+    return times;
+}
+
+// One band of the image's rows on one device. Its buffers hold the band
+// with halo rows of the image above and below, so the kernels filter it
+// as an image of its own and only the band's rows are kept.
+struct Band
+{
+    size_t device;
+    int begin, end;
+    // The band and its halo, as the kernels see them
+    Images imgs;
+    Buffers buffs;
+    // A pair of ping-pong buffers for each plane
+    vector<Buffer> images;
+    double time;
+};
+
+// Bytes in one row of one plane of an image
+size_t rowBytes(const Images &imgs)
+{
+    return imgs.dataSize / imgs.imageHeight;
+}
+
+// Bands over [0,height) in proportion to each device's speed. Devices
+// whose share rounds to no rows get no band.
+vector<Band> splitRows(int height, const vector<double> &speeds)
+{
+    double total = 0;
+    for (size_t i = 0; i < speeds.size(); i++)
+    {
+        total += speeds[i];
+    }
+
+    vector<Band> bands;
+    double share = 0;
+    int begin = 0;
+    for (size_t i = 0; i < speeds.size(); i++)
+    {
+        share += speeds[i];
+        int end = i + 1 == speeds.size()? height
+            : (int)std::floor(height * share / total + 0.5);
+        if (end > begin)
+        {
+            Band band;
+            band.device = i;
+            band.begin = begin;
+            band.end = end;
+            band.time = 0;
+            bands.push_back(band);
+        }
+        begin = std::max(begin, end);
+    }
+    return bands;
+}
+
+// Copies the band and its halo of the input image to the band's device.
+// Halo rows outside the image take the rows the border mode maps them to.
+void uploadBand(Band &band, const Images &imgs, Environment &env, int halo)
+{
+    TraceSpan span("upload band");
+    int rows = band.end - band.begin + halo*2;
+    size_t row = rowBytes(imgs);
+
+    Images &b = band.imgs;
+    b.imageWidth = imgs.imageWidth;
+    b.imageHeight = rows;
+    b.imageSize = rows * imgs.imageWidth;
+    b.dataSize = rows * row;
+    b.planes = imgs.planes;
+    b.border = imgs.border;
+    b.method = imgs.method;
+    b.inputImage.grey = imgs.inputImage.grey;
+    b.inputImage.storage = imgs.inputImage.storage;
+    b.inputImage.layout = imgs.inputImage.layout;
+
+    band.buffs = Buffers();
+    band.images.assign(imgs.planes*2, Buffer());
+
+    // Without copies each band is written straight into memory the device
+    // can reach, through a mapping, rather than staged and copied
+    PooledBuffer staging(env.zeroCopy? 0 : b.dataSize);
+    for (int plane = 0; plane < imgs.planes; plane++)
+    {
+        Buffer &image = band.images[plane*2];
+        char *dest = staging.as<char>();
+        if (env.zeroCopy)
+        {
+            image = Buffer (env.context,
+                            CL_MEM_READ_WRITE|CL_MEM_ALLOC_HOST_PTR,
+                            b.dataSize);
+            dest = (char*)env.queue.enqueueMapBuffer(image, CL_TRUE,
+                                                     CL_MAP_WRITE, 0,
+                                                     b.dataSize);
+        }
+
+        const char *source = planeData(imgs.inputImage, plane, imgs.dataSize);
+        for (int i = 0; i < rows; i++)
+        {
+            int from = borderIndex(band.begin - halo + i, imgs.imageHeight,
+                                   imgs.border);
+            if (from < 0)
+                memset(dest + i*row, 0, row);
+            else
+                memcpy(dest + i*row, source + from*row, row);
+        }
+
+        if (env.zeroCopy)
+        {
+            env.queue.enqueueUnmapMemObject(image, dest);
+        }
+        else
+        {
+            image = Buffer (env.context,
+                            CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,
+                            b.dataSize, dest);
+        }
+
+        band.images[plane*2 + 1] = Buffer (env.context,
+                                           CL_MEM_READ_WRITE|
+                                           (env.zeroCopy?
+                                            CL_MEM_ALLOC_HOST_PTR : 0),
+                                           b.dataSize);
+    }
+}
+
+void finishQueues(vector<Environment> &envs)
+{
+    for (size_t i = 0; i < envs.size(); i++)
+    {
+        envs[i].queue.finish();
+    }
+}
+
+// Rows of the image in the halo of a band for a filter of this radius
+template <class Function>
+void forHaloRows(const Band &band, int radius, Function visit)
+{
+    for (int row = band.begin - radius; row < band.begin; row++)
+    {
+        visit(row);
+    }
+    for (int row = band.end; row < band.end + radius; row++)
+    {
+        visit(row);
+    }
+}
+
+// Refreshes the halo rows a filter of this radius reads from the bands
+// holding them. The rows pass through the host's output image.
+void exchangeHalos(vector<Band> &bands, Images &imgs,
+                   vector<Environment> &envs, int current, int radius,
+                   int halo)
+{
+    TraceSpan span("exchange halos");
+    int height = imgs.imageHeight;
+    size_t row = rowBytes(imgs);
+    PooledBuffer zeros(row);
+    zeros.zero();
+
+    vector<char> needed(height, 0);
+    for (size_t b = 0; b < bands.size(); b++)
+    {
+        forHaloRows(bands[b], radius, [&](int image)
+        {
+            int source = borderIndex(image, height, imgs.border);
+            if (source >= 0)
+            {
+                needed[source] = 1;
+            }
+        });
+    }
+
+    for (int plane = 0; plane < imgs.planes; plane++)
+    {
+        char *host = planeData(imgs.outputImage, plane, imgs.dataSize);
+
+        // Runs of needed rows from the bands holding them
+        for (size_t b = 0; b < bands.size(); b++)
+        {
+            const Band &band = bands[b];
+            const CommandQueue &queue = envs[band.device].queue;
+            for (int first = band.begin; first < band.end; first++)
+            {
+                if (!needed[first])
+                {
+                    continue;
+                }
+                int last = first;
+                while (last + 1 < band.end && needed[last + 1])
+                {
+                    last++;
+                }
+                queue.enqueueReadBuffer(band.images[plane*2 + current],
+                                        CL_FALSE,
+                                        (first - band.begin + halo) * row,
+                                        (last - first + 1) * row,
+                                        host + first*row);
+                first = last;
+            }
+        }
+        finishQueues(envs);
+
+        for (size_t b = 0; b < bands.size(); b++)
+        {
+            const Band &band = bands[b];
+            const CommandQueue &queue = envs[band.device].queue;
+            forHaloRows(band, radius, [&](int image)
+            {
+                int source = borderIndex(image, height, imgs.border);
+                queue.enqueueWriteBuffer(band.images[plane*2 + current],
+                                         CL_FALSE,
+                                         (image - band.begin + halo) * row,
+                                         row, source < 0? zeros.data()
+                                         : host + source*row);
+            });
+        }
+        finishQueues(envs);
+    }
+}
+
+// Runs a filter on every band at once, each from a thread of its own as
+// waiting for each kernel blocks. Returns the time of the slowest band.
+double runBands(vector<Band> &bands, Filter *filter,
+                vector<Environment> &envs, int current)
+{
+    vector<std::thread> threads;
+    vector<std::exception_ptr> errors(bands.size());
+    for (size_t b = 0; b < bands.size(); b++)
+    {
+        threads.push_back(std::thread([&, b]()
+        {
+            try
+            {
+                Band &band = bands[b];
+                Environment &env = envs[band.device];
+                WorkGroup group = tunedWorkGroup(env, band.imgs, filter);
+                string options = buildOptions(band.imgs, filter, group);
+                createFilterBuffers(band.imgs, filter, env.context,
+                                    band.buffs);
+
+                // The planes' kernels queue back to back and are waited
+                // on once
+                EventChain chain;
+                for (int plane = 0; plane < band.imgs.planes; plane++)
+                {
+                    band.buffs.inputImage = band.images[plane*2 + current];
+                    band.buffs.outputImage =
+                        band.images[plane*2 + 1-current];
+                    enqueueFilter(band.imgs, filter, env, band.buffs,
+                                  options, group, chain);
+                }
+                band.time = finishChain(chain);
+            }
+            catch (...)
+            {
+                errors[b] = std::current_exception();
+            }
+        }));
+    }
+
+    double time = 0;
+    for (size_t b = 0; b < bands.size(); b++)
+    {
+        threads[b].join();
+        time = std::max(time, bands[b].time);
+    }
+    for (size_t b = 0; b < errors.size(); b++)
+    {
+        if (errors[b])
+        {
+            std::rethrow_exception(errors[b]);
+        }
+    }
+    return time;
+}
+
+// Splits the image into a band of rows for each device and runs the whole
+// chain with every band staying on its device, only halo rows moving
+// between filters. Bands are sized by the rows per ms each device managed
+// on the first filter of its first chain, which runs on equal shares.
+vector<double> runBandedChain(Images &imgs, const vector<Filter*> &filters,
+                              vector<Environment> &envs)
+{
+    int halo = 0;
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        halo = std::max(halo, (int)filters[i]->size()/2);
+    }
+
+    bool measured = true;
+    vector<double> speeds(envs.size());
+    for (size_t d = 0; d < envs.size(); d++)
+    {
+        speeds[d] = envs[d].rowsPerMs;
+        measured = measured && speeds[d] > 0;
+    }
+    if (!measured)
+    {
+        speeds.assign(envs.size(), 1);
+    }
+    vector<Band> bands = splitRows(imgs.imageHeight, speeds);
+
+    for (size_t b = 0; b < bands.size(); b++)
+    {
+        Band &band = bands[b];
+        char message[256];
+        snprintf(message, sizeof(message),
+                 "%s: rows %d to %d (%0.1f rows/ms)", envs[band.device].deviceName.c_str(), band.begin,
+                 band.end - 1, measured? speeds[band.device] : 0.0);
+        logLine(message);
+        uploadBand(band, imgs, envs[band.device], halo);
+    }
+
+    int current = 0;
+    vector<double> times;
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        Filter *filter = filters[i];
+        TraceSpan span("apply " + filter->filterName());
+
+        if (i > 0)
+        {
+            exchangeHalos(bands, imgs, envs, current, filter->size()/2,
+                          halo);
+        }
+        times.push_back(runBands(bands, filter, envs, current));
+        if (i == 0 && !measured)
+        {
+            for (size_t b = 0; b < bands.size(); b++)
+            {
+                envs[bands[b].device].rowsPerMs =
+                    (bands[b].end - bands[b].begin)
+                    / std::max(bands[b].time, 1e-3);
+            }
+        }
+
+        current = 1 - current;
+    }
+
+    // Only the band's own rows of each device's result are kept
+    size_t row = rowBytes(imgs);
+    for (int plane = 0; plane < imgs.planes; plane++)
+    {
+        char *host = planeData(imgs.outputImage, plane, imgs.dataSize);
+        for (size_t b = 0; b < bands.size(); b++)
+        {
+            const Band &band = bands[b];
+            envs[band.device].queue.enqueueReadBuffer(
+                band.images[plane*2 + current], CL_FALSE, halo * row,
+                (band.end - band.begin) * row, host + band.begin*row);
+        }
+    }
+    finishQueues(envs);
+    return times;
+}
+
+// Times every legal work group shape of the tiled and strip kernels for a
+// filter on the first plane of the image and keeps the fastest in the
+// tuning cache. Separable and box
+// filters run as kernels that leave the shape to the driver.
+void autotuneFilter(Images &imgs, Filter *filter, Environment &env)
+{
+    BoxShape box;
+    if (filter->separable() || findBoxShape(filter, box))
+    {
+        return;
+    }
+
+    static const int sizes[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    // Pixels per item of the tiled kernel, then of the strip kernel
+    static const int pixelsPerItem[] = {1, 2, 4, 4, 8};
+    static const bool strips[] = {false, false, false, true, true};
+    static const int sizeCount = sizeof(sizes)/sizeof(sizes[0]);
+    static const int pixelsCount = sizeof(pixelsPerItem)/sizeof(int);
+
+    size_t bufferSize = filter->size()/2;
+    size_t pixelSize = computePixelSize(imgs);
+    size_t maxGroup = env.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    vector<size_t> maxItems =
+        env.device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    cl_ulong localMemory = env.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+    Buffers buffs;
+    createFilterBuffers(imgs, filter, env.context, buffs);
+    createImageBuffers(imgs, env, buffs, 0);
+
+    WorkGroup best = tunedWorkGroup(env, imgs, filter);
+    double bestTime = HUGE_VAL;
+
+    for (int p = 0; p < pixelsCount; p++)
+    {
+        // A variant chosen on the command line is the only one tried
+        if (env.kernelVariant != "auto"
+            && strips[p] != (env.kernelVariant == "strip"))
+        {
+            continue;
+        }
+
+        WorkGroup group = {1, 1, pixelsPerItem[p], strips[p]};
+        string options = buildOptions(imgs, filter, group);
+        Kernel &kernel = getKernel(env, options, sparseTapSource(filter),
+                                   group.strip? "convolutionStrip"
+                                   : "convolution");
+        size_t kernelMax = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>
+            (env.device);
+
+        for (int r = 0; r < sizeCount; r++)
+        {
+            for (int c = 0; c < sizeCount; c++)
+            {
+                group.rows = sizes[r];
+                group.columns = sizes[c];
+
+                size_t items = group.rows * group.columns;
+                if (items > std::min(maxGroup, kernelMax)
+                    || (size_t)group.rows > maxItems[0]
+                    || (size_t)group.columns > maxItems[1]
+                    || localCacheSize(group, bufferSize) * pixelSize
+                       > localMemory)
+                {
+                    continue;
+                }
+
+                // Shapes bigger than the image only filter padding
+                if ((group.rows > 1 && group.rows > imgs.imageHeight)
+                    || (group.columns > 1 && group.columns
+                        * group.pixelsPerItem > imgs.imageWidth))
+                {
+                    continue;
+                }
+
+                double time = HUGE_VAL;
+                try
+                {
+                    for (int i = 0; i < TUNING_RUNS; i++)
+                    {
+                        time = std::min(time, runFilter(imgs, filter, env,
+                                                        buffs, options,
+                                                        group));
+                    }
+                }
+                catch (Error &)
+                {
+                    // Some devices refuse shapes that pass every query
+                    continue;
+                }
+
+                if (time < bestTime)
+                {
+                    bestTime = time;
+                    best = group;
+                }
+            }
+        }
+    }
+
+    env.tuning[tuningKey(env.deviceName, filter->size(),
+                         kernelPixelType(imgs))] = best;
+    char message[256];
+    snprintf(message, sizeof(message), "Tuned %s for %s: %dx%d work groups, "
+             "%d pixels per item%s (%0.3f ms)", filter->filterName().c_str(),
+             kernelPixelType(imgs).c_str(), best.rows, best.columns,
+             best.pixelsPerItem, best.strip? " in strips" : "", bestTime);
+    logLine(message);
+}
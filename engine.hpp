@@ -0,0 +1,223 @@
+#ifndef ENGINE_HPP_GUARD
+#define ENGINE_HPP_GUARD
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "filters.hpp"
+#include "bmp.hpp"
+#include "border.hpp"
+#include "cpu_convolution.hpp"
+#include "tuning.hpp"
+#include "pipeline.hpp"
+
+// The OpenCL and CPU machinery behind Pipeline and the command line. None
+// of it is part of the library's interface.
+
+struct Environment
+{
+    cl::Context             context;
+    std::vector<cl::Device> devices;
+    cl::Device            device;
+    std::string              deviceName;
+    cl::CommandQueue        queue;
+    std::string              source;
+    // Built programs and their kernels, keyed by the build options
+    std::map<std::string, cl::Program> programs;
+    std::map<std::string, cl::Kernel> kernels;
+    TuningCache tuning;
+    // Whether image buffers live in host memory, for CPU and integrated
+    // devices that share it, rather than being copied to the device
+    bool zeroCopy;
+    // "tiled" or "strip" to run every 2D filter with that kernel, or
+    // "auto" for whichever was tuned
+    std::string kernelVariant;
+    // Rows per ms of the first filter of the device's first banded chain,
+    // or 0 until then
+    double rowsPerMs;
+};
+
+struct Buffers
+{
+    cl::Buffer inputImage, outputImage, filter;
+    // Only used by separable filters
+    cl::Buffer intermediateImage, rowFilter, columnFilter;
+};
+
+struct Images
+{
+    int imageWidth, imageHeight, imageSize;
+    Bitmap inputImage, outputImage;
+    // Sizes are per plane. Planar colour images have three planes which
+    // are filtered one after the other, everything else has one.
+    size_t dataSize;
+    int planes;
+    // What the filters see outside the image
+    BorderMode border;
+    // How the CPU backend applies each filter
+    ConvolutionMethod method;
+};
+
+// Commands with their names, in the order enqueued
+typedef std::vector<std::pair<std::string, cl::Event> > KernelEvents;
+
+// Commands that run one after another without the host waiting between
+// them. Each waits on the one enqueued before it, and kernels are kept to
+// be timed and traced once they have run.
+struct EventChain
+{
+    std::vector<cl::Event> last;
+    // Each kernel's function name and event
+    KernelEvents kernels;
+
+    const std::vector<cl::Event> *waitList() const
+    {
+        return last.empty()? NULL : &last;
+    }
+    void add(const cl::Event &event) {last.assign(1, event);}
+};
+
+// Counts readbacks still to complete. The OpenCL runtime's callbacks count
+// them down, so the host only waits when it needs the pixels.
+class Readbacks
+{
+public:
+    Readbacks() : pending(0) {}
+
+    void expect(cl::Event &event)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending++;
+        }
+        event.setCallback(CL_COMPLETE, &Readbacks::completed, this);
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this]() {return pending == 0;});
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable done;
+    int pending;
+
+    static void CL_CALLBACK completed(cl_event, cl_int, void *data)
+    {
+        Readbacks *readbacks = (Readbacks*)data;
+        std::lock_guard<std::mutex> guard(readbacks->lock);
+        if (--readbacks->pending == 0)
+        {
+            readbacks->done.notify_all();
+        }
+    }
+};
+
+// A filter chain enqueued on the device and not yet finished. The image
+// buffers stay for the next chain over images of the same size.
+struct DeviceRun
+{
+    DeviceRun() : current(0), imageBytes(0), intermediateBytes(0) {}
+
+    // A pair of ping-pong buffers and a chain of commands for each plane
+    std::vector<cl::Buffer> images;
+    std::vector<EventChain> chains;
+    // Which buffer of each pair holds the latest result
+    int current;
+    // The intermediate image separable filters share, and the bytes the
+    // buffers were made for
+    cl::Buffer intermediateImage;
+    size_t imageBytes, intermediateBytes;
+    // Each filter's kernels, timed once they have run
+    std::vector<KernelEvents> filterKernels;
+    // Uploads and readbacks, traced once they have run
+    KernelEvents transfers;
+    // Readbacks of each plane, in order
+    std::vector<std::vector<cl::Event> > reads;
+    Readbacks readbacks;
+    // Results mapped without copies, unmapped once they are visible
+    std::vector<void*> mapped;
+};
+
+// Start of one plane of an image whose planes are planeBytes long
+char *planeData(const Bitmap &bmp, int plane, size_t planeBytes);
+
+// Makes the last filter's output the next filter's input
+void swapImages(Images &imgs);
+
+// Reads the input image and sizes the output image to match
+void initImages(Images &imgs, const std::string &inputFile,
+                PixelStorage storage, PixelLayout layout, BorderMode border,
+                ConvolutionMethod method);
+// The same for an input image already in imgs
+void initImages(Images &imgs, BorderMode border, ConvolutionMethod method);
+
+// Wall time since the timer was started, in ms
+double elapsedMs(const boost::timer::cpu_timer &timer);
+
+// Applies one filter on the CPU and returns the time it took, in ms
+double applyCpuFilter(Images &imgs, const Filter *filter, TapLoop taps);
+
+void listDevices();
+
+// One environment for each device the options select, each with the
+// tuning cache, running the kernels in this source file
+void initEnvironments(std::vector<Environment> &envs,
+                      const PipelineOptions &options,
+                      const std::string &sourceFile);
+
+// Kernels for one filter on one plane, built and run on their own
+WorkGroup tunedWorkGroup(const Environment &env, const Images &imgs,
+                         const Filter *filter);
+// The tuned shape if it is of this variant, otherwise a default one
+WorkGroup tunedWorkGroup(const Environment &env, const Images &imgs,
+                         const Filter *filter, const std::string &variant);
+std::string buildOptions(const Images &imgs, const Filter *filter,
+                         const WorkGroup &group);
+cl::Program &buildProgram(Environment &env, const std::string &options);
+// With generated taps ahead of the kernel source, if there are any
+cl::Program &buildProgram(Environment &env, const std::string &options,
+                          const std::string &taps);
+// The filter's non-zero taps as SPARSE_TAPS(TAP), a sum of TAP(row,
+// column) with taps of the same coefficient added before they are
+// multiplied, or empty if the taps are dense and all differ
+std::string sparseTapSource(const Filter *filter);
+void createFilterBuffers(const Images &imgs, Filter *filter,
+                         const cl::Context &context, Buffers &buffs);
+void createImageBuffers(const Images &imgs, const Environment &env,
+                        Buffers &buffs, int plane);
+double runFilter(const Images &imgs, Filter *filter, Environment &env,
+                 const Buffers &buffs, const std::string &options,
+                 const WorkGroup &group);
+// The tiled or strip kernel on its own, even for filters that would run
+// as separable or box kernels
+double runConvolution(const Images &imgs, Filter *filter, Environment &env,
+                      const Buffers &buffs, const std::string &options,
+                      const WorkGroup &group);
+void readOutputImage(Images &imgs, const Buffers &buffs, Environment &env,
+                     int plane);
+
+// Enqueues the whole chain on one device without waiting for it, and
+// waits for it to finish, returning each filter's time in ms
+void enqueueOpenCLFilters(Images &imgs, const std::vector<Filter*> &filters,
+                          Environment &env, bool pipeline, DeviceRun &run);
+std::vector<double> finishOpenCLFilters(Images &imgs, Environment &env,
+                                        DeviceRun &run);
+
+// Runs the whole chain split into bands of rows across the devices,
+// returning each filter's time in ms
+std::vector<double> runBandedChain(Images &imgs,
+                                   const std::vector<Filter*> &filters,
+                                   std::vector<Environment> &envs);
+
+// Keeps the fastest work group shape for a filter in env's tuning cache
+void autotuneFilter(Images &imgs, Filter *filter, Environment &env);
+
+#endif
@@ -0,0 +1,478 @@
+#include "fft.hpp"
+#include "cpu_convolution.hpp"
+#include "filter_factory.hpp"
+#include "parallel.hpp"
+#include "pool.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <complex>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <boost/timer/timer.hpp>
+
+using std::vector;
+using boost::timer::cpu_timer;
+
+typedef std::complex<float> Complex;
+
+// Side of the grey image the crossover is measured on
+static const int CALIBRATION_SIDE = 256;
+// Largest filter size tried when measuring the crossover
+static const int MAX_CALIBRATED_SIZE = 255;
+// Columns gathered together, so each row of the block is read a cache
+// line at a time rather than a pixel at a time
+static const int COLUMN_BATCH = 8;
+
+static inline float clampPixel(float val)
+{
+    return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+// Written out so the compiler does not call into the library to handle
+// infinities on every product
+static inline Complex multiply(Complex a, Complex b)
+{
+    return Complex(a.real()*b.real() - a.imag()*b.imag(),
+                   a.real()*b.imag() + a.imag()*b.real());
+}
+
+// Radix-2 transforms of n x n blocks, n a power of two, with the twiddle
+// factors and the bit-reversed order worked out up front
+class Fft
+{
+public:
+    explicit Fft(int n)
+        : n(n), twiddles(n/2), inverseTwiddles(n/2), reversed(n)
+    {
+        for (int i = 0; i < n/2; i++)
+        {
+            twiddles[i] = std::polar(1.0f, (float)(-2*M_PI*i/n));
+            inverseTwiddles[i] = std::conj(twiddles[i]);
+        }
+
+        int bits = 0;
+        while ((1 << bits) < n)
+        {
+            bits++;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            for (int b = 0; b < bits; b++)
+            {
+                reversed[i] |= ((i >> b) & 1) << (bits - 1 - b);
+            }
+        }
+    }
+
+    // Rows past the first rows of the block must be zero. Columns need
+    // scratch space for COLUMN_BATCH columns of n.
+    void forward(Complex *block, int rows, Complex *scratch) const
+    {
+        for (int y = 0; y < rows; y++)
+        {
+            transform(block + (size_t)y*n, twiddles);
+        }
+        transformColumns(block, twiddles, scratch);
+    }
+
+    // Unscaled, and only the first rows of the result are transformed
+    void inverse(Complex *block, int rows, Complex *scratch) const
+    {
+        transformColumns(block, inverseTwiddles, scratch);
+        for (int y = 0; y < rows; y++)
+        {
+            transform(block + (size_t)y*n, inverseTwiddles);
+        }
+    }
+
+private:
+    int n;
+    vector<Complex> twiddles, inverseTwiddles;
+    vector<int> reversed;
+
+    void transform(Complex *data, const vector<Complex> &twiddles) const
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (i < reversed[i])
+            {
+                std::swap(data[i], data[reversed[i]]);
+            }
+        }
+
+        for (int half = 1; half < n; half *= 2)
+        {
+            int step = n / (half*2);
+            for (int start = 0; start < n; start += half*2)
+            {
+                for (int k = 0; k < half; k++)
+                {
+                    Complex a = data[start + k];
+                    Complex b = multiply(data[start + k + half],
+                                         twiddles[k*step]);
+                    data[start + k] = a + b;
+                    data[start + k + half] = a - b;
+                }
+            }
+        }
+    }
+
+    // Columns are gathered into contiguous runs and scattered back
+    void transformColumns(Complex *block, const vector<Complex> &twiddles,
+                          Complex *scratch) const
+    {
+        int batch = std::min(COLUMN_BATCH, n);
+        for (int x = 0; x < n; x += batch)
+        {
+            for (int y = 0; y < n; y++)
+            {
+                for (int i = 0; i < batch; i++)
+                {
+                    scratch[(size_t)i*n + y] = block[(size_t)y*n + x + i];
+                }
+            }
+            for (int i = 0; i < batch; i++)
+            {
+                transform(scratch + (size_t)i*n, twiddles);
+            }
+            for (int y = 0; y < n; y++)
+            {
+                for (int i = 0; i < batch; i++)
+                {
+                    block[(size_t)y*n + x + i] = scratch[(size_t)i*n + y];
+                }
+            }
+        }
+    }
+};
+
+// Transform size for a filter: a power of two at least twice the filter
+// size, so tiles are wider than its spread, and larger if that does fewer
+// operations per output pixel without outgrowing the image
+static int transformSize(int size, int extent)
+{
+    int n = 16;
+    while (n < size*2)
+    {
+        n *= 2;
+    }
+
+    int best = n;
+    double bestCost = 0;
+    for (int i = 0; i < 3; i++, n *= 2)
+    {
+        int tile = n - size + 1;
+        double cost = (double)n*n*std::log2(n) / ((double)tile*tile);
+        if (i == 0 || cost < bestCost)
+        {
+            best = n;
+            bestCost = cost;
+        }
+        if (tile >= extent)
+        {
+            break;
+        }
+    }
+    return best;
+}
+
+template <class T>
+static void convolve(const T *input, T *output, int width, int height,
+                     int haloRows, int channels, const Filter *filter,
+                     BorderMode border)
+{
+    int size = filter->size();
+    int radius = size/2;
+    int inputHeight = height + haloRows*2;
+    // The output with the radius of pixels around it the filter reads
+    int extendedWidth = width + radius*2;
+    int extendedHeight = height + radius*2;
+
+    int n = transformSize(size, std::max(extendedWidth, extendedHeight));
+    int tile = n - size + 1;
+    int spread = tile + size - 1;
+    Fft fft(n);
+
+    // The filters correlate, so this is the spectrum of the flipped
+    // matrix, with the factor and the inverse's 1/(n*n) folded in
+    size_t blockSize = (size_t)n*n;
+    PooledBuffer spectrumBuffer(blockSize * sizeof(Complex));
+    PooledBuffer scratchBuffer((size_t)n*COLUMN_BATCH * sizeof(Complex));
+    spectrumBuffer.zero();
+    Complex *spectrum = spectrumBuffer.as<Complex>();
+    for (int fy = 0; fy < size; fy++)
+    {
+        for (int fx = 0; fx < size; fx++)
+        {
+            spectrum[(size_t)(size - 1 - fy)*n + size - 1 - fx] =
+                filter->filter()[fy*size + fx];
+        }
+    }
+    fft.forward(spectrum, size, scratchBuffer.as<Complex>());
+    float scale = filter->factor() / ((float)n*n);
+    for (size_t i = 0; i < blockSize; i++)
+    {
+        spectrum[i] *= scale;
+    }
+
+    // Tiles spread radius*2 rows above their own, into the row of tiles
+    // before, so sums are only kept for one row of tiles and those rows.
+    // Rows the next row of tiles cannot reach are written out as each row
+    // of tiles ends.
+    int reach = radius*2;
+    size_t rowSize = (size_t)width*channels;
+    PooledBuffer sumsBuffer((size_t)spread*rowSize * sizeof(float));
+    sumsBuffer.zero();
+    float *sums = sumsBuffer.as<float>();
+    int tileRows = (extendedHeight + tile - 1) / tile;
+    int tileColumns = (extendedWidth + tile - 1) / tile;
+    float bias = filter->bias();
+
+    for (int i = 0; i < tileRows; i++)
+    {
+        int top = i * tile;
+        int rows = std::min(tile, extendedHeight - top);
+
+        // Two channels go through each transform, one real and one
+        // imaginary, since the filter is real and keeps them apart. Tiles
+        // also spread into the column of tiles to their left but not the
+        // one before, so even and odd columns of tiles each run in
+        // parallel without sharing sums.
+        for (int c = 0; c < channels; c += 2)
+        {
+            bool paired = c + 1 < channels;
+            for (int phase = 0; phase < 2; phase++)
+            {
+                parallelRows((tileColumns - phase + 1) / 2,
+                             [&](int begin, int end)
+                {
+                    PooledBuffer blockBuffer(blockSize * sizeof(Complex));
+                    PooledBuffer scratchBuffer((size_t)n*COLUMN_BATCH
+                                               * sizeof(Complex));
+                    Complex *block = blockBuffer.as<Complex>();
+                    Complex *scratch = scratchBuffer.as<Complex>();
+
+                    for (int j = begin; j < end; j++)
+                    {
+                        int left = (j*2 + phase) * tile;
+                        int columns = std::min(tile, extendedWidth - left);
+
+                        std::fill(block, block + blockSize, Complex());
+                        for (int a = 0; a < rows; a++)
+                        {
+                            int row = borderIndex(top + a - radius
+                                                  + haloRows,
+                                                  inputHeight, border);
+                            if (row < 0)
+                            {
+                                continue;
+                            }
+                            const T *in = input + (size_t)row*rowSize;
+                            for (int b = 0; b < columns; b++)
+                            {
+                                int col = borderIndex(left + b - radius,
+                                                      width, border);
+                                if (col < 0)
+                                {
+                                    continue;
+                                }
+                                const T *p = in + (size_t)col*channels + c;
+                                block[(size_t)a*n + b] =
+                                    Complex(p[0], paired? p[1] : 0);
+                            }
+                        }
+
+                        fft.forward(block, rows, scratch);
+                        for (size_t k = 0; k < blockSize; k++)
+                        {
+                            block[k] = multiply(block[k], spectrum[k]);
+                        }
+                        fft.inverse(block, spread, scratch);
+
+                        // The full convolution is offset by the whole
+                        // filter width from the output. Row a of the
+                        // result goes to row a of the sums.
+                        for (int a = 0; a < spread; a++)
+                        {
+                            int y = top + a - reach;
+                            if (y < 0 || y >= height)
+                            {
+                                continue;
+                            }
+                            for (int b = 0; b < spread; b++)
+                            {
+                                int x = left + b - reach;
+                                if (x < 0 || x >= width)
+                                {
+                                    continue;
+                                }
+                                float *sum = &sums[(size_t)a*rowSize
+                                                   + (size_t)x*channels + c];
+                                Complex val = block[(size_t)a*n + b];
+                                sum[0] += val.real();
+                                if (paired)
+                                {
+                                    sum[1] += val.imag();
+                                }
+                            }
+                        }
+                    }
+                });
+            }
+        }
+
+        // The first tile rows of sums are finished, and the rest start
+        // the next row of tiles
+        int first = std::max(top - reach, 0);
+        int last = std::min(top + tile - reach, height);
+        if (last > first)
+        {
+            parallelRows(last - first, [&](int rowBegin, int rowEnd)
+            {
+                for (int y = first + rowBegin; y < first + rowEnd; y++)
+                {
+                    const float *sum = sums
+                        + (size_t)(y - top + reach)*rowSize;
+                    T *out = output + (size_t)y*rowSize;
+                    for (size_t k = 0; k < rowSize; k++)
+                    {
+                        out[k] = (T)clampPixel(sum[k] + bias);
+                    }
+                }
+            });
+        }
+        std::copy(sums + (size_t)tile*rowSize, sums + (size_t)spread*rowSize,
+                  sums);
+        std::fill(sums + (size_t)reach*rowSize, sums + (size_t)spread*rowSize,
+                  0.0f);
+    }
+}
+
+void fftConvolve(const float *input, float *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border)
+{
+    convolve(input, output, width, height, haloRows, 1, filter, border);
+}
+
+void fftConvolve(const cl_float4 *input, cl_float4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border)
+{
+    convolve((const float*)input, (float*)output,
+             width, height, haloRows, 4, filter, border);
+}
+
+void fftConvolve(const unsigned char *input, unsigned char *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border)
+{
+    convolve(input, output, width, height, haloRows, 1, filter, border);
+}
+
+void fftConvolve(const cl_uchar4 *input, cl_uchar4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border)
+{
+    convolve((const unsigned char*)input, (unsigned char*)output,
+             width, height, haloRows, 4, filter, border);
+}
+
+// Best of two runs, in ms
+template <class Function>
+static double bestTime(Function run)
+{
+    double best = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        cpu_timer timer;
+        run();
+        double time = timer.elapsed().wall / 1000000.0;
+        best = i == 0? time : std::min(best, time);
+    }
+    return best;
+}
+
+// Smallest filter size at which FFT beats the direct loops, or INT_MAX
+// if it never does up to MAX_CALIBRATED_SIZE. Blurs stand in for
+// separable filters and pseudo-random matrices for dense ones.
+static int measureCrossover(bool separable)
+{
+    int side = CALIBRATION_SIDE;
+    vector<float> image((size_t)side*side);
+    vector<float> output(image.size());
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        image[i] = (i * 7919) % 256;
+    }
+
+    for (int size = MAX_DIRECT_SIZE + 2; size <= MAX_CALIBRATED_SIZE;
+         size = (size*3/2) | 1)
+    {
+        vector<float> args;
+        if (separable)
+        {
+            args.push_back(size);
+            args.push_back(0);
+        }
+        else
+        {
+            for (int i = 0; i < size*size; i++)
+            {
+                args.push_back((float)((i * 37) % 11) - 5);
+            }
+        }
+        Filter *filter = FilterFactory().createFilter(
+            separable? "blur" : "custom", args);
+
+        double direct = bestTime([&]()
+        {
+            cpuConvolve(&image[0], &output[0], side, side, 0, filter,
+                        ZERO_BORDER, UNROLLED_TAPS, DIRECT_CONVOLUTION);
+        });
+        double fft = bestTime([&]()
+        {
+            fftConvolve(&image[0], &output[0], side, side, 0, filter,
+                        ZERO_BORDER);
+        });
+        delete filter;
+        if (fft < direct)
+        {
+            return size;
+        }
+    }
+    return INT_MAX;
+}
+
+bool fftIsFaster(const Filter *filter)
+{
+    if (filter->size() <= MAX_DIRECT_SIZE)
+    {
+        return false;
+    }
+
+    // Measured on first use, for separable and dense filters. Threads
+    // asking at the same time wait for the one measuring, rather than
+    // timing alongside it.
+    static std::once_flag measured[2];
+    static int crossover[2] = {0, 0};
+    int &size = crossover[filter->separable()];
+    std::call_once(measured[filter->separable()], [&]()
+    {
+        size = measureCrossover(filter->separable());
+        std::ostringstream message;
+        message << "FFT is faster for "
+                << (filter->separable()? "separable" : "dense")
+                << " filters from size ";
+        if (size == INT_MAX)
+            message << "above " << MAX_CALIBRATED_SIZE;
+        else
+            message << size;
+        logLine(message.str());
+    });
+    return filter->size() >= size;
+}
@@ -0,0 +1,42 @@
+#ifndef FFT_HPP_GUARD
+#define FFT_HPP_GUARD
+
+#include <CL/cl.hpp>
+#include "filters.hpp"
+#include "border.hpp"
+
+// Filters up to this size always take the direct loops, which are
+// unrolled for them
+static const int MAX_DIRECT_SIZE = 15;
+
+// Whether a filter is cheaper to apply by FFT than by the direct loops.
+// The first time a filter larger than MAX_DIRECT_SIZE is asked about, the
+// size at which FFT starts to win is measured on this machine, once for
+// dense filters and once for separable ones.
+bool fftIsFaster(const Filter *filter);
+
+// The same filtering as cpuConvolve, with the same arguments, done by
+// overlap-add: the input is cut into square tiles which are each
+// transformed, multiplied by the filter's spectrum and transformed back,
+// and the results are added into the output where their spread overlaps.
+// Sums are kept for one row of tiles at a time, so memory beyond the
+// output grows with the image width but not its height. Results match
+// the direct loops to float rounding, so byte pixels can occasionally
+// differ by one.
+void fftConvolve(const float *input, float *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border);
+
+void fftConvolve(const cl_float4 *input, cl_float4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border);
+
+void fftConvolve(const unsigned char *input, unsigned char *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border);
+
+void fftConvolve(const cl_uchar4 *input, cl_uchar4 *output,
+                 int width, int height, int haloRows,
+                 const Filter *filter, BorderMode border);
+
+#endif
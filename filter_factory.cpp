@@ -1,6 +1,16 @@
 #include "filter_factory.hpp"
 
+#include <stdexcept>
+
 Filter *FilterFactory::createFilter(std::string name, std::vector<float> args)
+{
+    Filter *filter = constructFilter(name, args);
+    filter->decompose();
+    return filter;
+}
+
+Filter *FilterFactory::constructFilter(std::string name,
+                                       std::vector<float> args)
 {
     to_lower(name);
     if (name == "sharpen")
@@ -15,8 +25,10 @@ Filter *FilterFactory::createFilter(std::string name, std::vector<float> args)
         return new Brighten(args);
     if (name == "edgedetect")
         return new EdgeDetect(args);
+    if (name == "custom")
+        return new Custom(args);
     else
-        throw "Invalid filter " + name;
+        throw std::invalid_argument("Invalid filter " + name);
 
     return NULL;
 }
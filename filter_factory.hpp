@@ -9,6 +9,9 @@ class FilterFactory
 {
 public:
     Filter *createFilter(std::string name, std::vector<float> args);
+
+private:
+    Filter *constructFilter(std::string name, std::vector<float> args);
 };
 
 #endif
@@ -2,12 +2,48 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 
 using std::string;
 
 BadFilterArguments::BadFilterArguments (Filter *filter)
     : msg("Bad number of arguments to filter " + filter->filterName()) {}
 
+Folded::Folded (Filter *first, Filter *second)
+    : _name(first->filterName() + "+" + second->filterName())
+{
+    int firstSize = first->size();
+    int secondSize = second->size();
+    _size = firstSize + secondSize - 1;
+    _filter = new float[_size*_size]();
+
+    const float *a = first->filter();
+    const float *b = second->filter();
+    for (int i = 0; i < firstSize; i++)
+    {
+        for (int j = 0; j < firstSize; j++)
+        {
+            for (int k = 0; k < secondSize; k++)
+            {
+                for (int l = 0; l < secondSize; l++)
+                {
+                    _filter[(i+k)*_size + j+l] +=
+                        a[i*firstSize+j] * b[k*secondSize+l];
+                }
+            }
+        }
+    }
+
+    float secondSum = 0;
+    for (int i = 0; i < secondSize*secondSize; i++)
+    {
+        secondSum += b[i];
+    }
+
+    _factor = first->factor() * second->factor();
+    _bias = first->bias() * second->factor() * secondSum + second->bias();
+}
+
 void Filter::checkArgs (std::vector<float> args, size_t size)
 {
     if (args.size() != size)
@@ -53,6 +89,68 @@ void Filter::fillFilterForDirection (float toFill, int direction)
     }
 }
 
+void Filter::decompose()
+{
+    // A single tap gains nothing from two passes
+    if (_size < 3)
+    {
+        return;
+    }
+
+    // The row and column through the largest coefficient span the filter
+    // if it is rank one
+    int pivot = 0;
+    for (int i = 0; i < _size*_size; i++)
+    {
+        if (std::fabs(_filter[i]) > std::fabs(_filter[pivot]))
+        {
+            pivot = i;
+        }
+    }
+
+    float pivotValue = _filter[pivot];
+    if (pivotValue == 0)
+    {
+        return;
+    }
+
+    int pivotRow = pivot / _size;
+    int pivotColumn = pivot % _size;
+
+    std::vector<float> row(_filter + pivotRow*_size,
+                           _filter + (pivotRow+1)*_size);
+    std::vector<float> column(_size);
+    for (int i = 0; i < _size; i++)
+    {
+        column[i] = _filter[i*_size + pivotColumn] / pivotValue;
+    }
+
+    float tolerance = std::fabs(pivotValue) * 1e-5f;
+    for (int i = 0; i < _size; i++)
+    {
+        for (int j = 0; j < _size; j++)
+        {
+            if (std::fabs(_filter[i*_size+j] - column[i]*row[j]) > tolerance)
+            {
+                return;
+            }
+        }
+    }
+
+    // A single line of taps would be split into a pass that only scales
+    // and one along the line, so it is left whole for one pass instead
+    if (std::count_if(row.begin(), row.end(),
+                      [](float c){return c != 0;}) == 1
+        || std::count_if(column.begin(), column.end(),
+                         [](float c){return c != 0;}) == 1)
+    {
+        return;
+    }
+
+    _rowFilter = row;
+    _columnFilter = column;
+}
+
 void Filter::printFilter()
 {
     for (int i = 0; i < _size; i++)
@@ -2,6 +2,7 @@
 #define FILTERS_HPP_GUARD
 #include <vector>
 #include <exception>
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 
 using boost::algorithm::to_lower;
@@ -9,24 +10,61 @@ using boost::algorithm::to_lower;
 class Filter
 {
 public:
+    Filter() : _filter(NULL) {}
+    virtual ~Filter() {delete[] _filter;}
+
     virtual const std::string filterName() {return "filter";}
     float *filter() {return _filter;}
+    const float *filter() const {return _filter;}
     float factor() const {return _factor;}
     float bias() const {return _bias;}
     float size () const {return _size;}
 
+    // A separable filter is the outer product columnFilter x rowFilter and
+    // can be run as a horizontal pass followed by a vertical one
+    bool separable() const {return !_rowFilter.empty();}
+    const std::vector<float> &rowFilter() const {return _rowFilter;}
+    const std::vector<float> &columnFilter() const {return _columnFilter;}
+
     void checkArgs (std::vector<float> args, size_t size);
+    void decompose();
 
 protected:
     float *_filter;
     float _factor;
     float _bias;
     int _size;
+    std::vector<float> _rowFilter;
+    std::vector<float> _columnFilter;
 
     void fillFilterForDirection(float toFill, int direction);
     void printFilter();
 };
 
+// Two filters run as one: the matrices are convolved together and the
+// first filter's factor and bias are carried through the second
+class Folded : public Filter
+{
+public:
+    const std::string filterName() {return _name;}
+
+    Folded (Filter *first, Filter *second);
+
+private:
+    std::string _name;
+};
+
+class BadFilterArguments : public std::exception
+{
+public:
+    BadFilterArguments(Filter *filter);
+    ~BadFilterArguments() throw() {}
+    const char* what() const throw() { return msg.c_str(); }
+
+private:
+    std::string msg;
+};
+
 class Sharpen : public Filter
 {
 public:
@@ -147,15 +185,30 @@ public:
     }
 };
 
-class BadFilterArguments : public std::exception
+class Custom : public Filter
 {
 public:
-    BadFilterArguments(Filter *filter);
-    ~BadFilterArguments() throw() {}
-    const char* what() const throw() { return msg.c_str(); }
+    const std::string filterName() {return "custom";}
 
-private:
-    std::string msg;
+    Custom (std::vector<float> args)
+    {
+        _size = 0;
+        while ((size_t)(_size*_size) < args.size())
+        {
+            _size++;
+        }
+
+        if ((size_t)(_size*_size) != args.size() || _size % 2 == 0)
+        {
+            throw BadFilterArguments(this);
+        }
+
+        _filter = new float[_size*_size];
+        std::copy(args.begin(), args.end(), _filter);
+
+        _factor = 1.0;
+        _bias = 0.0;
+    }
 };
 
 #endif
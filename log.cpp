@@ -0,0 +1,21 @@
+#include "log.hpp"
+
+#include <mutex>
+
+static std::mutex lock;
+static std::ostream *output = NULL;
+
+void setLog(std::ostream *stream)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    output = stream;
+}
+
+void logLine(const std::string &line)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (output)
+    {
+        *output << line << std::endl;
+    }
+}
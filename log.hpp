@@ -0,0 +1,17 @@
+#ifndef LOG_HPP_GUARD
+#define LOG_HPP_GUARD
+
+#include <ostream>
+#include <string>
+
+// Where the library reports what it does along the way, such as the files
+// it reads and writes, filters it folds, how it splits images between
+// devices and the work groups it tunes. Nothing is reported until a
+// stream is set, and setting NULL stops it again.
+void setLog(std::ostream *stream);
+
+// Writes a line to the stream set, if any. Lines written from several
+// threads at once come out whole.
+void logLine(const std::string &line);
+
+#endif
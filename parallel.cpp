@@ -0,0 +1,24 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+void parallelRows(int rows, std::function<void(int,int)> work)
+{
+    int threadCount = std::thread::hardware_concurrency();
+    threadCount = std::max(1, std::min(threadCount, rows));
+
+    std::vector<std::thread> threads;
+    int band = (rows + threadCount - 1) / threadCount;
+    for (int begin = 0; begin < rows; begin += band)
+    {
+        threads.push_back(std::thread(work, begin,
+                                      std::min(begin + band, rows)));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
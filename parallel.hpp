@@ -0,0 +1,10 @@
+#ifndef PARALLEL_HPP_GUARD
+#define PARALLEL_HPP_GUARD
+
+#include <functional>
+
+// Splits [0,rows) into contiguous bands, one per core, and calls
+// work(begin, end) for each band on its own thread
+void parallelRows(int rows, std::function<void(int,int)> work);
+
+#endif
@@ -0,0 +1,392 @@
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <boost/lexical_cast.hpp>
+
+#include "pipeline.hpp"
+#include "engine.hpp"
+#include "filter_factory.hpp"
+#include "planner.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+using boost::lexical_cast;
+
+PipelineOptions::PipelineOptions()
+    : backend("opencl"), devices("gpu"), subDevices(0), zeroCopy("auto"),
+      kernelVariant("auto"), tuningFile("tuning.cache"), pipeline(false), fold(false),
+      layout(INTERLEAVED_PIXELS), border(ZERO_BORDER),
+      method(AUTO_CONVOLUTION)
+{
+}
+
+float strToFloat (string s)
+{
+    return lexical_cast<float>(s);
+}
+
+Filter *createFilter(const string &filterDesc)
+{
+    static FilterFactory ff;
+
+    vector<string> strs;
+    boost::split(strs, filterDesc, boost::is_any_of(":"));
+    if (strs.size() != 2)
+    {
+        throw std::invalid_argument("Invalid filter " + filterDesc);
+    }
+
+    vector<string> args;
+    boost::split(args, strs[1], boost::is_any_of(","));
+
+    vector<float> floatArgs;
+    std::transform(args.begin(), args.end(),
+                   back_inserter(floatArgs),
+                   &strToFloat);
+
+    return ff.createFilter(strs[0], floatArgs);
+}
+
+// Devices running one kernel source, with the buffers of their last chain
+struct Devices
+{
+    vector<Environment> envs;
+    DeviceRun run;
+};
+
+struct Pipeline::State
+{
+    PipelineOptions options;
+    // The chain as it runs, and the filters in it the pipeline made
+    vector<Filter*> filters;
+    vector<Filter*> owned;
+    // Kept between runs, so that images of the same size take the same
+    // blocks from the pool
+    Images imgs;
+    // Keyed by kernel source file and made on first use, as grey and
+    // colour images run different kernels
+    map<string, Devices> devices;
+    vector<double> times;
+
+    ~State() {setChain(vector<Filter*>(), vector<Filter*>());}
+
+    void setChain(const vector<Filter*> &chain,
+                  const vector<Filter*> &created)
+    {
+        for (size_t i = 0; i < owned.size(); i++)
+        {
+            delete owned[i];
+        }
+        filters = chain.empty()? chain : planFilters(chain, options.fold);
+
+        // Filters folded together are replaced by ones the planner made
+        owned = created;
+        for (size_t i = 0; i < filters.size(); i++)
+        {
+            if (std::find(chain.begin(), chain.end(), filters[i])
+                == chain.end())
+            {
+                owned.push_back(filters[i]);
+            }
+        }
+    }
+
+    Devices &devicesFor(const Images &imgs)
+    {
+        // Each plane of a planar image is filtered as a grey image
+        string source = imgs.inputImage.singleChannel()?
+            "convolutiongrey.cl":"convolutioncolour.cl";
+        if (!options.kernelDirectory.empty())
+        {
+            source = options.kernelDirectory + "/" + source;
+        }
+
+        Devices &found = devices[source];
+        if (found.envs.empty())
+        {
+            initEnvironments(found.envs, options, source);
+        }
+        return found;
+    }
+
+    // Filters imgs.inputImage into imgs.outputImage
+    void apply()
+    {
+        times.clear();
+        if (filters.empty())
+        {
+            memcpy(imgs.outputImage.data(), imgs.inputImage.data(),
+                   imgs.dataSize * imgs.planes);
+            return;
+        }
+
+        if (options.backend == "cpu")
+        {
+            for (size_t i = 0; i < filters.size(); i++)
+            {
+                TraceSpan span("apply " + filters[i]->filterName());
+                if (i > 0)
+                {
+                    swapImages(imgs);
+                }
+                times.push_back(applyCpuFilter(imgs, filters[i],
+                                               UNROLLED_TAPS));
+            }
+            return;
+        }
+
+        Devices &found = devicesFor(imgs);
+        if (found.envs.size() > 1)
+        {
+            times = runBandedChain(imgs, filters, found.envs);
+            return;
+        }
+        enqueueOpenCLFilters(imgs, filters, found.envs[0], options.pipeline,
+                             found.run);
+        times = finishOpenCLFilters(imgs, found.envs[0], found.run);
+    }
+};
+
+Pipeline::Pipeline(const PipelineOptions &options)
+    : state(new State())
+{
+    state->options = options;
+}
+
+Pipeline::~Pipeline()
+{
+    // The images go back to the pool first
+    state.reset();
+    trimPool();
+}
+
+void Pipeline::setFilters(const vector<string> &descriptions)
+{
+    vector<Filter*> created;
+    try
+    {
+        for (size_t i = 0; i < descriptions.size(); i++)
+        {
+            created.push_back(createFilter(descriptions[i]));
+        }
+    }
+    catch (...)
+    {
+        // The chain is kept as it was
+        for (size_t i = 0; i < created.size(); i++)
+        {
+            delete created[i];
+        }
+        throw;
+    }
+    state->setChain(created, created);
+}
+
+void Pipeline::setFilters(const vector<Filter*> &filters)
+{
+    state->setChain(filters, vector<Filter*>());
+}
+
+const vector<Filter*> &Pipeline::filters() const
+{
+    return state->filters;
+}
+
+const vector<double> &Pipeline::filterTimes() const
+{
+    return state->times;
+}
+
+void Pipeline::run(Bitmap &image)
+{
+    Images &imgs = state->imgs;
+    void *pixels = image.data();
+    imgs.inputImage = std::move(image);
+    initImages(imgs, state->options.border, state->options.method);
+
+    try
+    {
+        state->apply();
+    }
+    catch (...)
+    {
+        // The CPU backend swaps its images between filters, so the
+        // caller's may be either
+        image = std::move(imgs.inputImage.data() == pixels?
+                          imgs.inputImage : imgs.outputImage);
+        imgs.inputImage.release();
+        imgs.outputImage.release();
+        throw;
+    }
+
+    image = std::move(imgs.outputImage);
+    imgs.inputImage.release();
+}
+
+// Start of a row of a view, as elements of T
+template <class T>
+static T *viewRow(const ImageView &view, int row)
+{
+    size_t stride = view.stride? view.stride
+        : (size_t)view.width * view.channels * sizeof(T);
+    return (T*)((char*)view.data + row * stride);
+}
+
+// Grey views are copied row by row. Colour channels go to the three planes
+// of planar bitmaps, or the first three lanes of interleaved ones.
+template <class T>
+static void copyIn(const ImageView &view, const Bitmap &bmp)
+{
+    T *pixels = (T*)bmp.data();
+    size_t planeSize = (size_t)view.width * view.height;
+    bool planar = bmp.singleChannel();
+    parallelRows(view.height, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            const T *row = viewRow<T>(view, i);
+            size_t first = (size_t)i * view.width;
+            if (view.channels == 1)
+            {
+                memcpy(pixels + first, row, view.width * sizeof(T));
+                continue;
+            }
+            for (int j = 0; j < view.width; j++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    T value = row[j*view.channels + c];
+                    if (planar)
+                        pixels[c*planeSize + first + j] = value;
+                    else
+                        pixels[(first + j)*4 + c] = value;
+                }
+            }
+        }
+    });
+}
+
+// The reverse of copyIn, taking any fourth channel from the input view
+template <class T>
+static void copyOut(const Bitmap &bmp, const ImageView &input,
+                    const ImageView &output)
+{
+    const T *pixels = (const T*)bmp.data();
+    size_t planeSize = (size_t)output.width * output.height;
+    bool planar = bmp.singleChannel();
+    parallelRows(output.height, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            T *row = viewRow<T>(output, i);
+            size_t first = (size_t)i * output.width;
+            if (output.channels == 1)
+            {
+                memcpy(row, pixels + first, output.width * sizeof(T));
+                continue;
+            }
+            const T *alpha = viewRow<T>(input, i) + 3;
+            for (int j = 0; j < output.width; j++)
+            {
+                T *pixel = row + j*output.channels;
+                for (int c = 0; c < 3; c++)
+                {
+                    pixel[c] = planar? pixels[c*planeSize + first + j]
+                        : pixels[(first + j)*4 + c];
+                }
+                if (output.channels == 4)
+                {
+                    pixel[3] = alpha[j*4];
+                }
+            }
+        }
+    });
+}
+
+void Pipeline::run(const ImageView &input, const ImageView &output)
+{
+    if (input.width != output.width || input.height != output.height
+        || input.channels != output.channels
+        || input.storage != output.storage)
+    {
+        throw std::invalid_argument("Input and output images differ in "
+                                    "size, channels or storage");
+    }
+    if (input.channels != 1 && input.channels != 3 && input.channels != 4)
+    {
+        throw std::invalid_argument("Images have 1, 3 or 4 channels");
+    }
+
+    // Fresh headers, as the last image's may be shared with the caller
+    Bitmap bmp;
+    bmp.grey = input.channels == 1;
+    bmp.storage = input.storage;
+    bmp.layout = state->options.layout;
+    bmp.infoHeader->biWidth = input.width;
+    bmp.infoHeader->biHeight = input.height;
+    bmp.infoHeader->biBitCount = bmp.grey? 8 : 24;
+    bmp.allocate((size_t)input.width * input.height);
+    if (input.storage == BYTE_PIXELS)
+        copyIn<unsigned char>(input, bmp);
+    else
+        copyIn<float>(input, bmp);
+
+    Images &imgs = state->imgs;
+    imgs.inputImage = std::move(bmp);
+    initImages(imgs, state->options.border, state->options.method);
+
+    state->apply();
+
+    if (input.storage == BYTE_PIXELS)
+        copyOut<unsigned char>(imgs.outputImage, input, output);
+    else
+        copyOut<float>(imgs.outputImage, input, output);
+}
+
+void Pipeline::autotune(Bitmap &image)
+{
+    if (state->options.backend != "opencl")
+    {
+        return;
+    }
+
+    Images &imgs = state->imgs;
+    imgs.inputImage = std::move(image);
+    initImages(imgs, state->options.border, state->options.method);
+    vector<Environment> &envs = state->devicesFor(imgs).envs;
+
+    // Once for each kind of device, sub-devices sharing the tuning of
+    // their device
+    TuningCache tuning = envs[0].tuning;
+    std::set<string> tuned;
+    for (size_t d = 0; d < envs.size(); d++)
+    {
+        if (!tuned.insert(envs[d].deviceName).second)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < state->filters.size(); i++)
+        {
+            autotuneFilter(imgs, state->filters[i], envs[d]);
+        }
+        for (TuningCache::iterator it = envs[d].tuning.begin();
+             it != envs[d].tuning.end(); it++)
+        {
+            tuning[it->first] = it->second;
+        }
+    }
+    for (size_t d = 0; d < envs.size(); d++)
+    {
+        envs[d].tuning = tuning;
+    }
+    saveTuningCache(state->options.tuningFile, tuning);
+
+    image = std::move(imgs.inputImage);
+}
@@ -0,0 +1,100 @@
+#ifndef PIPELINE_HPP_GUARD
+#define PIPELINE_HPP_GUARD
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "filters.hpp"
+#include "bmp.hpp"
+#include "border.hpp"
+#include "cpu_convolution.hpp"
+#include "log.hpp"
+
+// How a Pipeline filters, with the same meanings and defaults as the
+// command line options of the same names
+struct PipelineOptions
+{
+    PipelineOptions();
+
+    // "opencl" or "cpu"
+    std::string backend;
+    // "gpu", "all" or device numbers, and sub-devices of each
+    std::string devices;
+    int subDevices;
+    // "auto", "on" or "off"
+    std::string zeroCopy;
+    // "auto" for the tuned convolution kernel, "tiled" or "strip"
+    std::string kernelVariant;
+    // Tuned work groups are loaded from here, and saved by autotune
+    std::string tuningFile;
+    // Where convolutiongrey.cl and convolutioncolour.cl are, or empty for
+    // the working directory
+    std::string kernelDirectory;
+    // Whether only the final result is read back from the device
+    bool pipeline;
+    // Whether filters are folded even where that changes edge pixels or
+    // the clamp could trigger
+    bool fold;
+    // How colour images are held while they are filtered
+    PixelLayout layout;
+    BorderMode border;
+    ConvolutionMethod method;
+};
+
+// Pixels the caller owns. Rows are stride bytes apart, or packed if stride
+// is 0. Grey images have 1 channel and colour images 3 or 4, of bytes or
+// floats; a fourth channel is carried from the input to the output
+// without being filtered.
+struct ImageView
+{
+    void *data;
+    int width, height;
+    size_t stride;
+    int channels;
+    PixelStorage storage;
+};
+
+// A filter chain that runs on one set of devices for as many images as it
+// is given. Contexts, compiled kernels and device buffers are kept between
+// images, so only the first image of each size and type pays for them.
+// What it folds, splits and tunes along the way is reported through setLog.
+// OpenCL failures are thrown as cl::Error, which needs
+// __CL_ENABLE_EXCEPTIONS defined before CL/cl.hpp is first included.
+class Pipeline
+{
+public:
+    explicit Pipeline(const PipelineOptions &options = PipelineOptions());
+    ~Pipeline();
+
+    // The chain, as descriptions like "blur:5,0" or as filters the caller
+    // keeps. Adjacent filters are folded as planFilters decides.
+    void setFilters(const std::vector<std::string> &descriptions);
+    void setFilters(const std::vector<Filter*> &filters);
+    // The chain as it runs, after folding
+    const std::vector<Filter*> &filters() const;
+
+    // Filters the image in place. Its storage and layout are kept. If a
+    // filter throws, the image is handed back unfiltered, unless the CPU
+    // backend had already reused it for a later filter of the chain.
+    void run(Bitmap &image);
+    // Filters input into output, which has the same size, channels and
+    // storage
+    void run(const ImageView &input, const ImageView &output);
+
+    // Time each filter of the chain took in the last run, in ms
+    const std::vector<double> &filterTimes() const;
+
+    // Times every work group shape for each filter of the chain on the
+    // image, once for each kind of device, and saves the fastest to the
+    // tuning file
+    void autotune(Bitmap &image);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// A filter from a description like "blur:5,0"
+Filter *createFilter(const std::string &description);
+
+#endif
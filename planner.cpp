@@ -0,0 +1,75 @@
+#include "planner.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+using std::vector;
+
+// Larger filters need more local memory than the kernels can rely on
+static const int MAX_FOLDED_SIZE = 15;
+
+// True if some input in [0,255] takes the filter outside [0,255]
+static bool clampCanTrigger(Filter *filter)
+{
+    float positive = 0;
+    float negative = 0;
+    int size = filter->size();
+    for (int i = 0; i < size*size; i++)
+    {
+        float coeff = filter->filter()[i];
+        (coeff > 0? positive : negative) += coeff;
+    }
+
+    float low = negative * 255 * filter->factor() + filter->bias();
+    float high = positive * 255 * filter->factor() + filter->bias();
+    if (low > high)
+    {
+        std::swap(low, high);
+    }
+
+    return low < 0 || high > 255;
+}
+
+vector<Filter*> planFilters(const vector<Filter*> &filters, bool forceFold)
+{
+    vector<Filter*> plan;
+
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        Filter *filter = filters[i];
+
+        if (!plan.empty())
+        {
+            Filter *previous = plan.back();
+            int foldedSize = previous->size() + filter->size() - 1;
+
+            // A 1x1 filter reads no border, so folding it in is exact
+            bool exact = filter->size() == 1 && !clampCanTrigger(previous);
+            if (foldedSize <= MAX_FOLDED_SIZE && (forceFold || exact))
+            {
+                Filter *folded = new Folded(previous, filter);
+                folded->decompose();
+
+                std::ostringstream message;
+                message << "Folded " << previous->filterName() << " and "
+                        << filter->filterName() << " into one "
+                        << foldedSize << 'x' << foldedSize << " pass";
+                logLine(message.str());
+
+                // A fold from earlier in the run is replaced, not kept
+                if (std::find(filters.begin(), filters.end(), previous)
+                    == filters.end())
+                {
+                    delete previous;
+                }
+                plan.back() = folded;
+                continue;
+            }
+        }
+
+        plan.push_back(filter);
+    }
+
+    return plan;
+}
@@ -0,0 +1,17 @@
+#ifndef PLANNER_HPP_GUARD
+#define PLANNER_HPP_GUARD
+
+#include <vector>
+#include "filters.hpp"
+
+// Folds adjacent filters into one pass. By default a pair is only folded
+// when that gives the same result: the second filter is 1x1, and the
+// clamp after the first can never trigger for inputs in [0,255]. With
+// forceFold every pair that fits is folded, which changes results within
+// the filter radius of the image edges, as the border mode is no longer
+// applied to the intermediate image, and wherever the clamp would have
+// triggered.
+std::vector<Filter*> planFilters(const std::vector<Filter*> &filters,
+                                 bool forceFold);
+
+#endif
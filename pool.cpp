@@ -0,0 +1,157 @@
+#include "pool.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+struct FreeBlock
+{
+    size_t capacity;
+    void *block;
+};
+
+// Blocks waiting to be taken again. There are only ever a few, one or two
+// per image and per thread's scratch space, so they are searched in turn
+// and the list itself stops growing once the first stage has run.
+struct Pool
+{
+    std::mutex lock;
+    std::vector<FreeBlock> free;
+    PoolStats stats;
+};
+
+// Never destroyed, so buffers may outlive the end of main
+static Pool &pool()
+{
+    static Pool *pool = new Pool();
+    return *pool;
+}
+
+// Rather than hand a small request a much larger block, which would then
+// be missing for the next large one, the pool goes to the heap
+static const size_t MAX_SLACK = 2;
+
+PooledBuffer::PooledBuffer()
+    : block(NULL), bytes(0), capacity(0)
+{
+}
+
+PooledBuffer::PooledBuffer(size_t bytes)
+    : block(NULL), bytes(bytes), capacity(0)
+{
+    if (bytes == 0)
+    {
+        return;
+    }
+    // Any block of a page or more is then page aligned, whichever buffer
+    // takes it next
+    size_t alignment = bytes <= PAGE_ALIGNMENT - POOL_ALIGNMENT?
+        POOL_ALIGNMENT : PAGE_ALIGNMENT;
+    size_t wanted = (bytes + alignment - 1) / alignment * alignment;
+
+    Pool &p = pool();
+    {
+        std::lock_guard<std::mutex> guard(p.lock);
+        // The smallest block that fits
+        size_t best = p.free.size();
+        for (size_t i = 0; i < p.free.size(); i++)
+        {
+            size_t size = p.free[i].capacity;
+            if (size >= wanted && size <= wanted * MAX_SLACK
+                && (best == p.free.size() || size < p.free[best].capacity))
+            {
+                best = i;
+            }
+        }
+        if (best < p.free.size())
+        {
+            block = p.free[best].block;
+            capacity = p.free[best].capacity;
+            p.free[best] = p.free.back();
+            p.free.pop_back();
+            p.stats.reuses++;
+            return;
+        }
+        p.stats.allocations++;
+        p.stats.bytesAllocated += wanted;
+    }
+
+    if (posix_memalign(&block, alignment, wanted) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    capacity = wanted;
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&rhs)
+    : block(rhs.block), bytes(rhs.bytes), capacity(rhs.capacity)
+{
+    rhs.block = NULL;
+    rhs.bytes = rhs.capacity = 0;
+}
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer &&rhs)
+{
+    if (this != &rhs)
+    {
+        reset();
+        block = rhs.block;
+        bytes = rhs.bytes;
+        capacity = rhs.capacity;
+        rhs.block = NULL;
+        rhs.bytes = rhs.capacity = 0;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer()
+{
+    reset();
+}
+
+void PooledBuffer::zero()
+{
+    if (block)
+    {
+        memset(block, 0, bytes);
+    }
+}
+
+void PooledBuffer::reset()
+{
+    if (block)
+    {
+        Pool &p = pool();
+        std::lock_guard<std::mutex> guard(p.lock);
+        FreeBlock freed = {capacity, block};
+        p.free.push_back(freed);
+    }
+    block = NULL;
+    bytes = capacity = 0;
+}
+
+PoolStats poolStats()
+{
+    Pool &p = pool();
+    std::lock_guard<std::mutex> guard(p.lock);
+    PoolStats stats = p.stats;
+    stats.bytesFree = 0;
+    for (size_t i = 0; i < p.free.size(); i++)
+    {
+        stats.bytesFree += p.free[i].capacity;
+    }
+    return stats;
+}
+
+void trimPool()
+{
+    Pool &p = pool();
+    std::lock_guard<std::mutex> guard(p.lock);
+    for (size_t i = 0; i < p.free.size(); i++)
+    {
+        free(p.free[i].block);
+    }
+    p.free.clear();
+}
@@ -0,0 +1,60 @@
+#ifndef POOL_HPP_GUARD
+#define POOL_HPP_GUARD
+
+#include <cstddef>
+
+// Every pooled block starts on a cache line, which also suits the widest
+// vector loads
+static const size_t POOL_ALIGNMENT = 64;
+// Blocks of a page or more start on a page and fill whole pages, which
+// OpenCL devices sharing host memory need to use them without copying
+static const size_t PAGE_ALIGNMENT = 4096;
+
+// A block of image memory from a process-wide pool. Destroying the buffer
+// hands its block back to the pool rather than to the heap, and the next
+// buffer of a size the block fits takes it again, so a chain of filters
+// over same-sized images only allocates for its first stage. A block
+// belongs to one buffer at a time: buffers move but do not copy.
+class PooledBuffer
+{
+public:
+    PooledBuffer();
+    // At least this many bytes, uninitialised
+    explicit PooledBuffer(size_t bytes);
+    PooledBuffer(PooledBuffer &&rhs);
+    PooledBuffer &operator=(PooledBuffer &&rhs);
+    ~PooledBuffer();
+
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    void *data() const {return block;}
+    size_t size() const {return bytes;}
+    template <class T> T *as() const {return (T*)block;}
+
+    void zero();
+    // Hands the block back to the pool, leaving the buffer empty
+    void reset();
+
+private:
+    void *block;
+    size_t bytes, capacity;
+};
+
+// Blocks taken from the heap and blocks handed out again by the pool
+// since the start of the run, and the bytes now waiting in the pool
+struct PoolStats
+{
+    size_t allocations, reuses;
+    size_t bytesAllocated;
+    size_t bytesFree;
+};
+
+PoolStats poolStats();
+
+// Frees every block waiting in the pool. Pipelines do this as they are
+// destroyed and the server once it goes idle, so sizes that are no longer
+// used do not stay pinned.
+void trimPool();
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef QUEUE_HPP_GUARD
+#define QUEUE_HPP_GUARD
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// A queue between threads that holds at most capacity items, so a fast
+// producer waits for its consumer rather than running ahead of it without
+// bound. Closing the queue wakes every waiting thread.
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity), closed(false)
+    {
+    }
+
+    // Waits for room. False if the queue is closed first.
+    bool push(T &&item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notFull.wait(guard, [this]() {
+            return closed || items.size() < capacity;
+        });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Takes the item only if there is room now
+    bool tryPush(T &&item)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (closed || items.size() >= capacity)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Waits for an item. False once the queue is closed and empty.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait(guard, [this]() {return closed || !items.empty();});
+        return take(item);
+    }
+
+    // Waits at most timeout for an item. False if none came.
+    template <class Duration>
+    bool pop(T &item, Duration timeout)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait_for(guard, timeout,
+                          [this]() {return closed || !items.empty();});
+        return take(item);
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return items.size();
+    }
+
+    size_t limit() const {return capacity;}
+
+    // Pushes fail from now on, and pops take what is left
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    // With the lock held
+    bool take(T &item)
+    {
+        if (items.empty())
+        {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    std::mutex lock;
+    std::condition_variable notFull, notEmpty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+};
+
+#endif
@@ -0,0 +1,338 @@
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "serve.hpp"
+#include "queue.hpp"
+#include "trace.hpp"
+#include "pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <CL/cl.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/timer/timer.hpp>
+
+using std::string;
+using std::vector;
+
+// Larger requests are refused rather than allocated
+static const size_t MAX_REQUEST_BYTES = 256 << 20;
+// Latencies kept for the percentiles, the most recent first to go
+static const size_t LATENCY_SAMPLES = 4096;
+// How long the server waits without requests before freeing the image
+// memory pooled for the sizes it has seen
+static const std::chrono::seconds IDLE_TRIM(1);
+
+bool readLine(int fd, string &line)
+{
+    line.clear();
+    char c;
+    while (read(fd, &c, 1) == 1)
+    {
+        if (c == '\n')
+        {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+bool readBytes(int fd, void *data, size_t size)
+{
+    char *to = (char*)data;
+    while (size > 0)
+    {
+        ssize_t got = read(fd, to, size);
+        if (got <= 0)
+        {
+            return false;
+        }
+        to += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool writeBytes(int fd, const void *data, size_t size)
+{
+    const char *from = (const char*)data;
+    while (size > 0)
+    {
+        // A client that hangs up only ends its own connection
+        ssize_t sent = send(fd, from, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            return false;
+        }
+        from += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool writeLine(int fd, const string &line)
+{
+    return writeBytes(fd, (line + "\n").c_str(), line.size() + 1);
+}
+
+static sockaddr_un socketAddress(const string &path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+int connectServer(const string &socketPath)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = socketAddress(socketPath);
+    if (fd >= 0 && connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// One request, from the connection that read it to the thread running the
+// pipeline and back
+struct Job
+{
+    string filters;
+    ImageView input, output;
+    vector<unsigned char> pixels, result;
+    boost::timer::cpu_timer received;
+    // Empty once filtered, otherwise what went wrong
+    std::promise<string> done;
+};
+
+struct Server
+{
+    explicit Server(int queueDepth) : jobs(queueDepth), served(0), rejected(0)
+    {
+    }
+
+    BoundedQueue<std::shared_ptr<Job> > jobs;
+
+    std::mutex lock;
+    size_t served, rejected;
+    vector<double> latencies;
+
+    void record(double ms)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (latencies.size() == LATENCY_SAMPLES)
+        {
+            latencies.erase(latencies.begin());
+        }
+        latencies.push_back(ms);
+        served++;
+    }
+
+    string stats()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        double p50 = 0, p99 = 0;
+        if (!sorted.empty())
+        {
+            p50 = sorted[(sorted.size() - 1) * 50 / 100];
+            p99 = sorted[(sorted.size() - 1) * 99 / 100];
+        }
+
+        PoolStats pool = poolStats();
+        char text[512];
+        snprintf(text, sizeof(text),
+                 "served %zu\nrejected %zu\nqueue %zu of %zu\n"
+                 "p50 %0.3f ms\np99 %0.3f ms\n"
+                 "pool %zu allocations, %zu reuses, %0.1f MB allocated, "
+                 "%0.1f MB free\n",
+                 served, rejected, jobs.size(), jobs.limit(), p50, p99,
+                 pool.allocations, pool.reuses,
+                 pool.bytesAllocated / (1024.0 * 1024.0),
+                 pool.bytesFree / (1024.0 * 1024.0));
+        return text;
+    }
+};
+
+// Filters jobs one at a time. The chain only changes when a request asks
+// for a different one.
+static void runJobs(Server &server, Pipeline &pipeline)
+{
+    string chain;
+    std::shared_ptr<Job> job;
+    while (true)
+    {
+        if (!server.jobs.pop(job, IDLE_TRIM))
+        {
+            // Nothing to do, so the pool need not hold on to its blocks
+            trimPool();
+            if (!server.jobs.pop(job))
+            {
+                break;
+            }
+        }
+
+        TraceSpan span("serve " + job->filters);
+        string error;
+        try
+        {
+            if (job->filters != chain)
+            {
+                vector<string> descriptions;
+                boost::split(descriptions, job->filters,
+                             boost::is_any_of(";"));
+                chain.clear();
+                pipeline.setFilters(descriptions);
+                chain = job->filters;
+            }
+            pipeline.run(job->input, job->output);
+        }
+        catch (cl::Error &e)
+        {
+            std::ostringstream message;
+            message << e.what() << "(" << e.err() << ")";
+            error = message.str();
+        }
+        catch (std::exception &e)
+        {
+            error = e.what();
+        }
+        catch (...)
+        {
+            error = "filter failed";
+        }
+
+        server.record(job->received.elapsed().wall / 1000000.0);
+        job->done.set_value(error);
+    }
+}
+
+// Answers one FILTER request whose line has been read
+static bool serveFilter(Server &server, int fd, std::istringstream &line)
+{
+    std::shared_ptr<Job> job(new Job());
+    int width = 0, height = 0, channels = 0;
+    line >> width >> height >> channels >> job->filters;
+    size_t bytes = (size_t)width * height * channels;
+    if (width <= 0 || height <= 0
+        || (channels != 1 && channels != 3 && channels != 4)
+        || bytes > MAX_REQUEST_BYTES)
+    {
+        // The payload cannot be skipped without a size to trust
+        writeLine(fd, "ERROR bad image size");
+        return false;
+    }
+
+    job->pixels.resize(bytes);
+    job->result.resize(bytes);
+    if (!readBytes(fd, &job->pixels[0], bytes))
+    {
+        return false;
+    }
+    job->received.start();
+
+    ImageView input = {&job->pixels[0], width, height, 0, channels,
+                       BYTE_PIXELS};
+    job->input = input;
+    job->output = input;
+    job->output.data = &job->result[0];
+
+    // The worker lets go of the job once it is done, and the result is
+    // still to be sent
+    std::shared_ptr<Job> queued = job;
+    std::future<string> done = job->done.get_future();
+    if (!server.jobs.tryPush(std::move(queued)))
+    {
+        std::lock_guard<std::mutex> guard(server.lock);
+        server.rejected++;
+        return writeLine(fd, "BUSY");
+    }
+
+    string error = done.get();
+    if (!error.empty())
+    {
+        return writeLine(fd, "ERROR " + error);
+    }
+    return writeLine(fd, "OK " + std::to_string(bytes))
+        && writeBytes(fd, &job->result[0], bytes);
+}
+
+static void serveConnection(Server &server, int fd)
+{
+    string line;
+    while (readLine(fd, line))
+    {
+        std::istringstream words(line);
+        string command;
+        words >> command;
+
+        bool open;
+        if (command == "FILTER")
+        {
+            open = serveFilter(server, fd, words);
+        }
+        else if (command == "STATS")
+        {
+            string stats = server.stats();
+            open = writeLine(fd, "OK " + std::to_string(stats.size()))
+                && writeBytes(fd, stats.c_str(), stats.size());
+        }
+        else
+        {
+            open = writeLine(fd, "ERROR unknown command " + command);
+        }
+
+        if (!open)
+        {
+            break;
+        }
+    }
+    close(fd);
+}
+
+void runServer(const PipelineOptions &options, const string &socketPath,
+               int queueDepth)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = socketAddress(socketPath);
+    unlink(socketPath.c_str());
+    if (listener < 0
+        || bind(listener, (sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener, SOMAXCONN) != 0)
+    {
+        std::cout << "Could not listen on " << socketPath << std::endl;
+        exit(-1);
+    }
+
+    Server server(queueDepth);
+    Pipeline pipeline(options);
+    std::thread worker(runJobs, std::ref(server), std::ref(pipeline));
+
+    std::cout << "Serving on " << socketPath << std::endl;
+    while (true)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+        // Connections wait on the worker rather than the other way round,
+        // so each has a thread of its own
+        std::thread(serveConnection, std::ref(server), fd).detach();
+    }
+}
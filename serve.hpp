@@ -0,0 +1,38 @@
+#ifndef SERVE_HPP_GUARD
+#define SERVE_HPP_GUARD
+
+#include <string>
+#include <vector>
+#include "pipeline.hpp"
+
+// Requests to the --serve socket are a line of text, followed by any
+// payload the line gives the size of:
+//
+//   FILTER <width> <height> <channels> <filters>
+//     then width*height*channels bytes of packed 8-bit pixels. Filters
+//     are descriptions like blur:5,0 separated by ';'.
+//   STATS
+//
+// and each is answered in turn by one of
+//
+//   OK <bytes>        then the filtered pixels or the statistics as text
+//   BUSY              the queue was full and the request was not taken
+//   ERROR <message>
+//
+// A connection may send any number of requests.
+
+// Serves requests on a Unix domain socket at socketPath until the process
+// is stopped. One pipeline filters every request, so contexts, kernels and
+// buffers stay warm between them. At most queueDepth requests wait for it
+// and any more are answered BUSY at once.
+void runServer(const PipelineOptions &options, const std::string &socketPath,
+               int queueDepth);
+
+// Both ends of the protocol. connectServer returns -1 and the others
+// false when the connection fails.
+int connectServer(const std::string &socketPath);
+bool readLine(int fd, std::string &line);
+bool readBytes(int fd, void *data, size_t size);
+bool writeBytes(int fd, const void *data, size_t size);
+
+#endif
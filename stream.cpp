@@ -0,0 +1,162 @@
+#include "stream.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <boost/timer/timer.hpp>
+
+#include "bmp.hpp"
+#include "cpu_convolution.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+
+using std::vector;
+using std::string;
+using boost::timer::cpu_timer;
+
+// Rows of the strip [begin, end) that lie outside the image take the
+// rows the border mode maps them to. For zero, clamp and mirror borders
+// those always lie inside the strip, as each strip carries the halo of
+// every filter still to run.
+template <class T>
+static void fillBorderRows(vector<T> &rows, int begin, int end,
+                           int width, int height, BorderMode border)
+{
+    for (int row = begin; row < end; row++)
+    {
+        if (row >= 0 && row < height)
+        {
+            continue;
+        }
+
+        T *dest = &rows[(size_t)(row - begin) * width];
+        int source = borderIndex(row, height, border);
+        if (source < 0)
+        {
+            std::fill(dest, dest + width, T());
+        }
+        else
+        {
+            std::copy(rows.begin() + (size_t)(source - begin) * width,
+                      rows.begin() + (size_t)(source - begin + 1) * width,
+                      dest);
+        }
+    }
+}
+
+template <class T>
+static void streamFilters(BitmapReader &reader, BitmapWriter &writer,
+                          const vector<Filter*> &filters, int stripHeight,
+                          BorderMode border, ConvolutionMethod method)
+{
+    int width = reader.width();
+    int height = reader.height();
+
+    int halo = 0;
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        halo += filters[i]->size()/2;
+    }
+
+    int maxRows = stripHeight + halo*2;
+
+    // window holds image rows [windowBegin, windowEnd), which is the
+    // current strip plus its halo. Rows outside the image come from the
+    // border mode.
+    vector<T> window((size_t)maxRows * width);
+    vector<T> stage((size_t)maxRows * width);
+    vector<T> filtered((size_t)maxRows * width);
+    int windowBegin = -halo;
+    int windowEnd = -halo;
+
+    vector<double> times(filters.size(), 0);
+
+    for (int stripBegin = 0; stripBegin < height; stripBegin += stripHeight)
+    {
+        TraceSpan stripSpan("strip");
+        int stripEnd = std::min(stripBegin + stripHeight, height);
+        int begin = stripBegin - halo;
+        int end = stripEnd + halo;
+
+        // Keep the halo rows shared with the previous strip and read the
+        // rest, which always continues where the last read stopped
+        int kept = std::max(0, windowEnd - begin);
+        std::copy(window.begin() + (size_t)(begin - windowBegin) * width,
+                  window.begin() + (size_t)(windowEnd - windowBegin) * width,
+                  window.begin());
+        {
+            TraceSpan span("read rows");
+            for (int row = std::max(begin + kept, 0);
+                 row < std::min(end, height); row++)
+            {
+                reader.readRows(1, &window[(size_t)(row - begin) * width]);
+            }
+        }
+        fillBorderRows(window, begin, end, width, height, border);
+        windowBegin = begin;
+        windowEnd = end;
+
+        // Run the chain, losing each filter's radius from the strip
+        const vector<T> *input = &window;
+        for (size_t i = 0; i < filters.size(); i++)
+        {
+            TraceSpan span("apply " + filters[i]->filterName());
+            int radius = filters[i]->size()/2;
+            int rows = end - begin - radius*2;
+
+            cpu_timer timer;
+            cpuConvolve(&(*input)[0], &filtered[0], width, rows, radius,
+                        filters[i], border, UNROLLED_TAPS, method);
+            times[i] += timer.elapsed().wall / 1000000.0;
+
+            begin += radius;
+            end -= radius;
+
+            // The next filter sees the border mode outside the image too
+            fillBorderRows(filtered, begin, end, width, height, border);
+
+            stage.swap(filtered);
+            input = &stage;
+        }
+
+        TraceSpan span("write rows");
+        writer.writeRows(stripEnd - stripBegin, &(*input)[0]);
+    }
+
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        char took[64];
+        snprintf(took, sizeof(took), "Filter took %0.3f ms to apply",
+                 times[i]);
+        logLine("Applying " + filters[i]->filterName());
+        logLine(took);
+    }
+}
+
+void streamFilters(const string &inputFile, const string &outputFile,
+                   const vector<Filter*> &filters, int stripHeight,
+                   PixelStorage storage, BorderMode border,
+                   ConvolutionMethod method)
+{
+    BitmapReader reader(inputFile);
+    BitmapWriter writer(outputFile, reader.header);
+    bool grey = reader.header.grey;
+
+    if (storage == BYTE_PIXELS)
+    {
+        if (grey)
+            streamFilters<unsigned char>(reader, writer, filters, stripHeight,
+                                         border, method);
+        else
+            streamFilters<cl_uchar4>(reader, writer, filters, stripHeight,
+                                     border, method);
+    }
+    else
+    {
+        if (grey)
+            streamFilters<float>(reader, writer, filters, stripHeight,
+                                 border, method);
+        else
+            streamFilters<cl_float4>(reader, writer, filters, stripHeight,
+                                     border, method);
+    }
+}
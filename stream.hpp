@@ -0,0 +1,23 @@
+#ifndef STREAM_HPP_GUARD
+#define STREAM_HPP_GUARD
+
+#include <string>
+#include <vector>
+#include "filters.hpp"
+#include "bmp.hpp"
+#include "border.hpp"
+#include "cpu_convolution.hpp"
+
+// Runs the filter chain over the input file in horizontal strips of
+// stripHeight output rows on the CPU backend. Each strip is read with
+// enough halo rows for every filter in the chain and written out as soon
+// as it is done, so peak memory depends on the strip size rather than on
+// the image size. Wrapping borders need rows from the far end of the
+// image, so they cannot be streamed.
+void streamFilters(const std::string &inputFile,
+                   const std::string &outputFile,
+                   const std::vector<Filter*> &filters,
+                   int stripHeight, PixelStorage storage,
+                   BorderMode border, ConvolutionMethod method);
+
+#endif
@@ -0,0 +1,230 @@
+#include "trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::ostringstream;
+using std::endl;
+
+// Host spans go in one process with a row per thread, each queue's OpenCL
+// commands in another with a row for time spent waiting and one for time
+// running
+static const int HOST_PID = 1;
+static const int DEVICE_PID = 2;
+static const int WAITING_TID = 1;
+static const int RUNNING_TID = 2;
+
+struct Trace
+{
+    Trace() : enabled(false) {}
+
+    // Checked by every span on any thread without the lock, which guards
+    // everything else. It is set last when tracing starts, and rechecked
+    // under the lock before anything is recorded.
+    std::atomic<bool> enabled;
+    string filename;
+    std::chrono::steady_clock::time_point origin;
+    vector<string> events;
+    map<std::thread::id, int> threads;
+    // Each queue's process, and its device time in ns minus host time in
+    // ns once known. Every device, and so every queue, keeps a clock of
+    // its own.
+    map<cl_command_queue, int> devicePids;
+    map<cl_command_queue, long long> deviceOffsets;
+    std::mutex lock;
+};
+
+static Trace &trace()
+{
+    static Trace t;
+    return t;
+}
+
+// Host time since startTrace, in us
+static double now()
+{
+    return std::chrono::duration<double, std::micro>
+        (std::chrono::steady_clock::now() - trace().origin).count();
+}
+
+static string quote(const string &s)
+{
+    string quoted = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+        {
+            quoted += '\\';
+        }
+        quoted += s[i];
+    }
+    return quoted + "\"";
+}
+
+static void addEvent(const string &name, const string &category,
+                     int pid, int tid, double begin, double end)
+{
+    ostringstream event;
+    event.precision(15);
+    event << "{\"name\": " << quote(name)
+          << ", \"cat\": " << quote(category)
+          << ", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << tid
+          << ", \"ts\": " << begin << ", \"dur\": " << end - begin << "}";
+    trace().events.push_back(event.str());
+}
+
+static void addName(int pid, const string &name)
+{
+    ostringstream event;
+    event << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+          << ", \"args\": {\"name\": " << quote(name) << "}}";
+    trace().events.push_back(event.str());
+}
+
+void startTrace(const string &filename)
+{
+    Trace &t = trace();
+    std::lock_guard<std::mutex> guard(t.lock);
+    t.filename = filename;
+    t.origin = std::chrono::steady_clock::now();
+    t.devicePids.clear();
+    t.deviceOffsets.clear();
+    addName(HOST_PID, "host");
+    t.enabled = true;
+}
+
+void finishTrace()
+{
+    Trace &t = trace();
+    std::lock_guard<std::mutex> guard(t.lock);
+    if (!t.enabled)
+    {
+        return;
+    }
+
+    std::ofstream file(t.filename.c_str());
+    file << "{\"traceEvents\": [" << endl;
+    for (size_t i = 0; i < t.events.size(); i++)
+    {
+        file << "  " << t.events[i]
+             << (i + 1 < t.events.size()? "," : "") << endl;
+    }
+    file << "]}" << endl;
+    t.enabled = false;
+}
+
+bool tracing()
+{
+    return trace().enabled;
+}
+
+void calibrateTrace(const cl::CommandQueue &queue)
+{
+    Trace &t = trace();
+    if (!t.enabled)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(t.lock);
+        if (t.deviceOffsets.count(queue()))
+        {
+            return;
+        }
+    }
+
+    // The device stamps the marker as queued while the host enqueues it
+    cl::Event marker;
+    double host = now();
+    queue.enqueueMarker(&marker);
+    marker.wait();
+    cl_ulong queued;
+    marker.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queued);
+
+    std::lock_guard<std::mutex> guard(t.lock);
+    if (!t.enabled)
+    {
+        return;
+    }
+    t.deviceOffsets[queue()] = (long long)queued - (long long)(host * 1000.0);
+}
+
+void traceEvent(const string &name, const cl::Event &event)
+{
+    Trace &t = trace();
+    if (!t.enabled)
+    {
+        return;
+    }
+
+    cl_ulong queued, submitted, started, ended;
+    event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queued);
+    event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &submitted);
+    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &started);
+    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &ended);
+
+    cl::CommandQueue commands = event.getInfo<CL_EVENT_COMMAND_QUEUE>();
+    calibrateTrace(commands);
+    cl_command_queue queue = commands();
+
+    std::lock_guard<std::mutex> guard(t.lock);
+    if (!t.enabled)
+    {
+        return;
+    }
+    if (!t.devicePids.count(queue))
+    {
+        int pid = DEVICE_PID + t.devicePids.size();
+        t.devicePids[queue] = pid;
+        addName(pid, "OpenCL queue " + std::to_string(pid - DEVICE_PID));
+    }
+    int pid = t.devicePids[queue];
+
+    long long offset = t.deviceOffsets[queue];
+
+    double q = ((long long)queued - offset) / 1000.0;
+    double s = ((long long)submitted - offset) / 1000.0;
+    double b = ((long long)started - offset) / 1000.0;
+    double e = ((long long)ended - offset) / 1000.0;
+    addEvent("queued " + name, "queue", pid, WAITING_TID, q, s);
+    addEvent("submitted " + name, "queue", pid, WAITING_TID, s, b);
+    addEvent(name, "device", pid, RUNNING_TID, b, e);
+}
+
+TraceSpan::TraceSpan(const string &name)
+    : name(name),
+      begin(tracing()? now() : 0)
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+    Trace &t = trace();
+    if (!t.enabled)
+    {
+        return;
+    }
+
+    double end = now();
+    std::lock_guard<std::mutex> guard(t.lock);
+    if (!t.enabled)
+    {
+        return;
+    }
+    std::thread::id id = std::this_thread::get_id();
+    if (!t.threads.count(id))
+    {
+        int next = t.threads.size() + 1;
+        t.threads[id] = next;
+    }
+    addEvent(name, "host", HOST_PID, t.threads[id], begin, end);
+}
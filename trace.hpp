@@ -0,0 +1,36 @@
+#ifndef TRACE_HPP_GUARD
+#define TRACE_HPP_GUARD
+
+#include <string>
+#include <CL/cl.hpp>
+
+// A timeline of host work and OpenCL commands in the Chrome trace event
+// format, for chrome://tracing or Perfetto. Nothing is recorded until
+// startTrace is called, and finishTrace writes the file.
+void startTrace(const std::string &filename);
+void finishTrace();
+bool tracing();
+
+// Pairs the queue's device clock with the host clock, using a marker
+// enqueued now. Environments do this as their queue is made, before its
+// first command. Queues made before tracing started are paired on their
+// first traced command instead.
+void calibrateTrace(const cl::CommandQueue &queue);
+
+// Records the queued, submitted and running phases of a finished command,
+// moving its device timestamps onto the host clock with its queue's pair
+void traceEvent(const std::string &name, const cl::Event &event);
+
+// Records the host time between construction and destruction
+class TraceSpan
+{
+public:
+    TraceSpan(const std::string &name);
+    ~TraceSpan();
+
+private:
+    std::string name;
+    double begin;
+};
+
+#endif
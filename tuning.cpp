@@ -0,0 +1,63 @@
+#include "tuning.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::ofstream;
+using boost::lexical_cast;
+
+string tuningKey(const string &device, int filterSize,
+                 const string &pixelType)
+{
+    std::ostringstream key;
+    key << device << '\t' << filterSize << '\t' << pixelType;
+    return key.str();
+}
+
+void loadTuningCache(const string &filename, TuningCache &cache)
+{
+    ifstream file(filename.c_str());
+    string line;
+    while (std::getline(file, line))
+    {
+        vector<string> fields;
+        boost::split(fields, line, boost::is_any_of("\t"));
+        if (fields.size() != 6 && fields.size() != 7)
+        {
+            continue;
+        }
+
+        try
+        {
+            WorkGroup group;
+            group.rows = lexical_cast<int>(fields[3]);
+            group.columns = lexical_cast<int>(fields[4]);
+            group.pixelsPerItem = lexical_cast<int>(fields[5]);
+            group.strip = fields.size() == 7
+                && lexical_cast<int>(fields[6]) != 0;
+            cache[fields[0] + '\t' + fields[1] + '\t' + fields[2]] = group;
+        }
+        catch (boost::bad_lexical_cast &)
+        {
+            // Skip lines that have been mangled by hand
+        }
+    }
+}
+
+void saveTuningCache(const string &filename, const TuningCache &cache)
+{
+    ofstream file(filename.c_str());
+    TuningCache::const_iterator it;
+    for (it = cache.begin(); it != cache.end(); it++)
+    {
+        file << it->first << '\t' << it->second.rows << '\t'
+             << it->second.columns << '\t' << it->second.pixelsPerItem
+             << '\t' << it->second.strip << std::endl;
+    }
+}
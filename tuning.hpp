@@ -0,0 +1,29 @@
+#ifndef TUNING_HPP_GUARD
+#define TUNING_HPP_GUARD
+
+#include <map>
+#include <string>
+
+// Shape of the work groups of the tiled convolution kernel. Each work
+// item filters pixelsPerItem pixels of its row, a work group width apart,
+// or with strip set the pixelsPerItem neighbouring pixels of the
+// convolutionStrip kernel.
+struct WorkGroup
+{
+    int rows, columns, pixelsPerItem;
+    bool strip;
+};
+
+// Tuned work groups for each device, filter size and pixel type
+typedef std::map<std::string, WorkGroup> TuningCache;
+
+std::string tuningKey(const std::string &device, int filterSize,
+                      const std::string &pixelType);
+
+// The file has one tab separated line per entry: device, filter size,
+// pixel type, rows, columns, pixels per item and 1 for strips. A missing
+// file is an empty cache, and lines from before strips are not strips.
+void loadTuningCache(const std::string &filename, TuningCache &cache);
+void saveTuningCache(const std::string &filename, const TuningCache &cache);
+
+#endif